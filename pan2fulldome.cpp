@@ -30,29 +30,68 @@
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <list>
+#include <map>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <csetjmp>
 #include <fstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
 #include <time.h>
 #include <opencv2/opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
+#ifndef PAN2FULLDOME_CLI
 #include <opencv2/highgui.hpp>
 #include "tinyfiledialogs.h"
+#endif
+
+#ifdef HAVE_LIBJPEG
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
 
+#ifndef PAN2FULLDOME_CLI
 #define CVUI_IMPLEMENTATION
 #include "cvui.h"
 
 #define WINDOW_NAME "PAN2FULLDOME - HIT <esc> TO CLOSE"
+#endif
+#define PREVIEW_WIDTH 400
 
 #define CV_PI   3.1415926535897932384626433832795
 
-cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh) {
+void fisheyeMap(cv::Mat& map_x, cv::Mat& map_y, int firstrow, int outputw, int outputh, int rotate_down, int srcw, int srch, int firstcol = 0) {
+	// fills map_x, map_y with the rows firstrow to firstrow+map_x.rows, and the columns
+	// firstcol to firstcol+map_x.cols, of the outputw x outputh fisheye,
+	// pointing into an equirect source of size srcw x srch
 	// from https://github.com/hn-88/OCVWarp/blob/master/OCVWarp.cpp
 	// line 924
-	cv::Size Sout = cv::Size(outputw,outputh);
-	// taking vars from line 955
-	cv::Mat res;
-	cv::Mat dst(Sout, CV_8UC3); // Sout = dst.size, and src.type = CV_8UC3
-	cv::Mat dst_x, dst_y;
 
 	//////////////////////////////////////////////
 	// Equirectangular 360 to 180 degree fisheye
@@ -60,19 +99,18 @@ cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh) {
 	
 		// using the transformations at
 		// http://paulbourke.net/dome/dualfish2sphere/diagram.pdf
-  		cv::Mat map_x, map_y; //  initialize these, line 987
-		map_x = cv::Mat(Sout, CV_32FC1);
-		map_y = cv::Mat(Sout, CV_32FC1);
 		// line 1003
-		map_x = cv::Scalar((outputw+outputh)*10);
-    		map_y = cv::Scalar((outputw+outputh)*10);
+		map_x = cv::Scalar((srcw+srch)*10);
+    		map_y = cv::Scalar((srcw+srch)*10);
     		// initializing so that it points outside the image
     		// so that unavailable pixels will be black
 	
-		int xcd = floor(map_x.cols/2) - 1 ;
-		int ycd = floor(map_x.rows/2) - 1 ;
-		float halfcols = map_x.cols/2;
-		float halfrows = map_x.rows/2;
+		int xcd = floor(outputw/2) - 1 ;
+		int ycd = floor(outputh/2) - 1 ;
+		float halfcols = outputw/2;
+		float halfrows = outputh/2;
+		int srcxcd = floor(srcw/2) - 1 ;
+		int srcycd = floor(srch/2) - 1 ;
 
 		int anglex = -90;
 		int angley = rotate_down;		
@@ -95,8 +133,8 @@ cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh) {
 				for ( int j = 0; j < map_x.cols; j++ )
 				{
 					// normalizing to [-1, 1]
-					xfish = (j - xcd) / halfcols;
-					yfish = (i - ycd) / halfrows;
+					xfish = (firstcol + j - xcd) / halfcols;
+					yfish = (firstrow + i - ycd) / halfrows;
 					rfish = sqrt(xfish*xfish + yfish*yfish);
 					theta = atan2(yfish, xfish);
 					phi = rfish*aperture/2;
@@ -140,13 +178,13 @@ cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh) {
 					// removed the black circle to help transformtype=5
 					// avoid bottom pixels black
 					{
-						map_x.at<float>(i, j) =  abs(xequi * map_x.cols / 2 + xcd);
+						map_x.at<float>(i, j) =  abs(xequi * srcw / 2 + srcxcd);
 						//map_y.at<float>(i, j) =  yequi * map_x.rows / 2 + ycd;
 						// this gets south pole centred view
 						
 						// the abs is to correct for -0.5 xequi value at longi=0
 						
-						map_y.at<float>(i, j) =  yequi * map_x.rows / 2 + ycd;
+						map_y.at<float>(i, j) =  yequi * srch / 2 + srcycd;
 						//debug
 						//~ if (rfish <= 1.0/500)
 						//if ((longi==0)||(longi==CV_PI)||(longi==-CV_PI))
@@ -165,14 +203,596 @@ cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh) {
 			} // for i
 	// this completes update_map()
 	////////////////////////////////
-	cv::convertMaps(map_x, map_y, dst_x, dst_y, CV_16SC2);	// supposed to make it faster to remap
-	cv::resize( equirect, res, cv::Size(outputw, outputh), 0, 0, cv::INTER_CUBIC);
-	cv::remap( res, dst, dst_x, dst_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0) );
-	return dst;			
-	
 }
 
-cv::Mat equirectToFisheye(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int rotate_down, int outputw)
+// cv::remap keeps source coordinates in 16 bit fixed point,
+// so it can only address sources up to SHRT_MAX pixels across
+#define REMAP_MAX_EXTENT (SHRT_MAX - 16)
+// output block size for remapTiled
+#define REMAP_BLOCK 128
+// extra source pixels around each block's window, enough for INTER_LANCZOS4
+#define REMAP_MARGIN 4
+
+// source bytes up to which a block's window is prefetched, about an L2's worth
+#define REMAP_PREFETCH_BYTES (256*1024)
+// output size from which ocvwarp1 remaps block by block
+#define REMAP_TILED_MIN 2048
+
+cv::Rect sourceWindow(const cv::Mat& src, const cv::Mat& map_x, const cv::Mat& map_y, cv::Rect block)
+{
+	// the part of src the map points to for this block of the output, with a margin
+	// for the interpolation kernel, clipped to src
+	cv::Mat bx = map_x(block), by = map_y(block);
+	double minx, maxx, miny, maxy;
+	cv::minMaxLoc(bx, &minx, &maxx);
+	cv::minMaxLoc(by, &miny, &maxy);
+	cv::Rect window(cvFloor(minx) - REMAP_MARGIN, cvFloor(miny) - REMAP_MARGIN, 0, 0);
+	window.width = cvCeil(maxx) + REMAP_MARGIN + 1 - window.x;
+	window.height = cvCeil(maxy) + REMAP_MARGIN + 1 - window.y;
+	return window & cv::Rect(0, 0, src.cols, src.rows);
+}
+
+void remapBlock(const cv::Mat& src, cv::Mat& dst, const cv::Mat& map_x, const cv::Mat& map_y, cv::Rect block,
+	cv::Rect window, int interpolation, const cv::Scalar& borderval)
+{
+	// remaps one block of the output against just the window of src its map points to
+	if (window.empty()) {
+		// the whole block points outside the source
+		dst(block) = borderval;
+		return;
+	}
+	if (window.width > REMAP_MAX_EXTENT || window.height > REMAP_MAX_EXTENT) {
+		// too wide a footprint, for example across the longitude seam, so split the block
+		if (block.width == 1 && block.height == 1) {
+			dst(block) = borderval;
+			return;
+		}
+		cv::Rect a = block, b = block;
+		if (block.width >= block.height) {
+			a.width = block.width / 2;
+			b.x += a.width;
+			b.width -= a.width;
+		}
+		else {
+			a.height = block.height / 2;
+			b.y += a.height;
+			b.height -= a.height;
+		}
+		remapBlock(src, dst, map_x, map_y, a, sourceWindow(src, map_x, map_y, a), interpolation, borderval);
+		remapBlock(src, dst, map_x, map_y, b, sourceWindow(src, map_x, map_y, b), interpolation, borderval);
+		return;
+	}
+	// coordinates rebased to the window, in maps kept by each thread, which no block outgrows
+	static thread_local cv::Mat blockx, blocky;
+	blockx.create(REMAP_BLOCK, REMAP_BLOCK, CV_32F);
+	blocky.create(REMAP_BLOCK, REMAP_BLOCK, CV_32F);
+	cv::Mat wx = blockx(cv::Rect(0, 0, block.width, block.height));
+	cv::Mat wy = blocky(cv::Rect(0, 0, block.width, block.height));
+	map_x(block).convertTo(wx, CV_32F, 1, -window.x);
+	map_y(block).convertTo(wy, CV_32F, 1, -window.y);
+	cv::Mat out = dst(block);
+	cv::remap(src(window), out, wx, wy, interpolation, cv::BORDER_CONSTANT, borderval);
+}
+
+static inline unsigned mortonKey(unsigned x, unsigned y)
+{
+	// interleaves the bits of x and y, which are below 65536
+	unsigned key = 0;
+	for (int b = 0; b < 16; b++) {
+		key |= ((x >> b) & 1u) << (2*b);
+		key |= ((y >> b) & 1u) << (2*b + 1);
+	}
+	return key;
+}
+
+static inline void prefetchWindow(const cv::Mat& src, cv::Rect window)
+{
+	// asks for the source rows of a window to be brought into cache,
+	// unless the window is too big for that to help
+	if ((size_t)window.area() * src.elemSize() > REMAP_PREFETCH_BYTES)
+		return;
+#if defined(__GNUC__)
+	const size_t rowbytes = (size_t)window.width * src.elemSize();
+	for (int y = window.y; y < window.y + window.height; y++) {
+		const uchar* row = src.ptr<uchar>(y) + (size_t)window.x * src.elemSize();
+		for (size_t b = 0; b < rowbytes; b += 64)
+			__builtin_prefetch(row + b);
+	}
+#endif
+}
+
+void remapTiled(const cv::Mat& src, cv::Mat& dst, const cv::Mat& map_x, const cv::Mat& map_y, int interpolation, const cv::Scalar& borderval)
+{
+	// same as cv::remap with CV_32FC1 maps and BORDER_CONSTANT, but for sources of any size:
+	// the output is split into blocks, and each block is remapped against a sub-view
+	// of the source with its coordinates rebased, so no block needs more than 16 bit coordinates.
+	// The renders still sample an intermediate of at most 8192 px (intermediateSize), not the
+	// pan itself, so only ocvwarp1's res, outputw across, can be beyond SHRT_MAX, with
+	// a full frame render wider than 32767 px.
+	// The fisheye sweeps the source along curves, so a row of blocks touches source rows
+	// far apart. Visiting the blocks in Z order keeps consecutive blocks on neighbouring
+	// parts of the source, and each thread takes a run of them, prefetching the next
+	// block's window while remapping the current one.
+	dst.create(map_x.size(), src.type());
+	std::vector<cv::Rect> blocks;
+	for (int y = 0; y < map_x.rows; y += REMAP_BLOCK) {
+		for (int x = 0; x < map_x.cols; x += REMAP_BLOCK) {
+			blocks.push_back(cv::Rect(x, y, std::min(REMAP_BLOCK, map_x.cols - x), std::min(REMAP_BLOCK, map_x.rows - y)));
+		}
+	}
+	std::sort(blocks.begin(), blocks.end(), [](const cv::Rect& a, const cv::Rect& b) {
+		return mortonKey(a.x / REMAP_BLOCK, a.y / REMAP_BLOCK) < mortonKey(b.x / REMAP_BLOCK, b.y / REMAP_BLOCK);
+	});
+	std::vector<cv::Rect> windows(blocks.size());
+	cv::parallel_for_(cv::Range(0, (int)blocks.size()), [&](const cv::Range& range) {
+		for (int k = range.start; k < range.end; k++)
+			windows[k] = sourceWindow(src, map_x, map_y, blocks[k]);
+	});
+	// a few runs per thread, long enough for the Z order to pay off
+	const double runs = std::max(1, cv::getNumThreads()) * 4;
+	cv::parallel_for_(cv::Range(0, (int)blocks.size()), [&](const cv::Range& range) {
+		for (int k = range.start; k < range.end; k++) {
+			if (k + 1 < range.end)
+				prefetchWindow(src, windows[k + 1]);
+			remapBlock(src, dst, map_x, map_y, blocks[k], windows[k], interpolation, borderval);
+		}
+	}, runs);
+}
+
+//////////////////////////////////////////////
+// Compact map storage, for maps which are kept. A pair of float maps
+// costs 8 bytes per output pixel. Packed, each coordinate is a 16 bit
+// offset from its tile's origin, with as many fraction bits as the
+// tile's extent leaves room for, 4 bytes per pixel, decoded inside the
+// remap loop. CV_16F would need no origins, but its spacing is already
+// 4 pixels at x = 8192.
+
+// tiles of PACKED_TILE x PACKED_TILE output pixels share an origin and a step
+#define PACKED_TILE 32
+// finest step kept, 1/256 pixel
+#define PACKED_MAX_FRAC_BITS 8
+
+enum MapStorage { MAP_FLOAT, MAP_FIXED16 };
+
+struct PackedMap {
+	cv::Size size;
+	int tilesacross;
+	// per tile, the coordinate of offset 0 and the size of one unit of offset.
+	// The positional error is at most half a step, 1/512 pixel when a tile
+	// spans less than 256 source pixels, 1/2 pixel when it spans the whole
+	// of a 32k intermediate, as near the zenith.
+	std::vector<cv::Point2f> origin;
+	std::vector<float> step;
+	cv::Mat xy;	// CV_16UC2 offsets
+};
+
+void packMap(const cv::Mat& map_x, const cv::Mat& map_y, PackedMap& pm)
+{
+	pm.size = map_x.size();
+	pm.tilesacross = (map_x.cols + PACKED_TILE - 1) / PACKED_TILE;
+	int tilesdown = (map_x.rows + PACKED_TILE - 1) / PACKED_TILE;
+	pm.origin.resize(pm.tilesacross * tilesdown);
+	pm.step.resize(pm.tilesacross * tilesdown);
+	pm.xy.create(map_x.size(), CV_16UC2);
+	cv::parallel_for_(cv::Range(0, tilesdown), [&](const cv::Range& range) {
+		for (int ty = range.start; ty < range.end; ty++) {
+			for (int tx = 0; tx < pm.tilesacross; tx++) {
+				cv::Rect tile(tx * PACKED_TILE, ty * PACKED_TILE, 0, 0);
+				tile.width = std::min(PACKED_TILE, map_x.cols - tile.x);
+				tile.height = std::min(PACKED_TILE, map_x.rows - tile.y);
+				double minx, maxx, miny, maxy;
+				cv::minMaxLoc(map_x(tile), &minx, &maxx);
+				cv::minMaxLoc(map_y(tile), &miny, &maxy);
+				float ox = (float)floor(minx), oy = (float)floor(miny);
+				double span = std::max(maxx - ox, maxy - oy);
+				int fracbits = PACKED_MAX_FRAC_BITS;
+				while (fracbits > 0 && span * (1 << fracbits) > USHRT_MAX)
+					fracbits--;
+				float scale = (float)(1 << fracbits);
+				int t = ty * pm.tilesacross + tx;
+				pm.origin[t] = cv::Point2f(ox, oy);
+				pm.step[t] = 1.f / scale;
+				for (int i = tile.y; i < tile.y + tile.height; i++) {
+					const float* mx = map_x.ptr<float>(i);
+					const float* my = map_y.ptr<float>(i);
+					ushort* p = pm.xy.ptr<ushort>(i);
+					for (int j = tile.x; j < tile.x + tile.width; j++) {
+						p[2*j] = cv::saturate_cast<ushort>((mx[j] - ox) * scale);
+						p[2*j+1] = cv::saturate_cast<ushort>((my[j] - oy) * scale);
+					}
+				}
+			}
+		}
+	});
+}
+
+static inline void bilinearTap(const cv::Mat& img, float u, float v, float weight, float* acc, float border = 0.f)
+{
+	// adds weight * img(v, u) to acc, bilinear, with border outside img: black,
+	// or 128 for the chroma planes of the YCbCr path.
+	// img is CV_8UC3 or, for the planes of the YCbCr path, CV_8UC1
+	int x0 = cvFloor(u), y0 = cvFloor(v);
+	float fx = u - x0, fy = v - y0;
+	float w[4] = { (1.f-fx)*(1.f-fy), fx*(1.f-fy), (1.f-fx)*fy, fx*fy };
+	const int cn = img.channels();
+	for (int k = 0; k < 4; k++) {
+		int x = x0 + (k & 1), y = y0 + (k >> 1);
+		float wk = weight * w[k];
+		if (x < 0 || y < 0 || x >= img.cols || y >= img.rows) {
+			for (int c = 0; c < cn; c++)
+				acc[c] += wk * border;
+			continue;
+		}
+		const uchar* p = img.ptr<uchar>(y) + cn*x;
+		for (int c = 0; c < cn; c++)
+			acc[c] += wk * p[c];
+	}
+}
+
+void remapPacked(const cv::Mat& src, cv::Mat& dst, const PackedMap& pm)
+{
+	// cv::remap with INTER_LINEAR and a black BORDER_CONSTANT, for a CV_8UC3 src and a packed map
+	CV_Assert(src.type() == CV_8UC3);
+	dst.create(pm.size, CV_8UC3);
+	cv::parallel_for_(cv::Range(0, pm.size.height), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++) {
+			const ushort* p = pm.xy.ptr<ushort>(i);
+			uchar* d = dst.ptr<uchar>(i);
+			const int firsttile = (i / PACKED_TILE) * pm.tilesacross;
+			for (int j = 0; j < pm.size.width; j++) {
+				const int t = firsttile + j / PACKED_TILE;
+				float acc[3] = { 0.f, 0.f, 0.f };
+				bilinearTap(src, pm.origin[t].x + p[2*j] * pm.step[t], pm.origin[t].y + p[2*j+1] * pm.step[t], 1.f, acc);
+				d[3*j] = cv::saturate_cast<uchar>(acc[0]);
+				d[3*j+1] = cv::saturate_cast<uchar>(acc[1]);
+				d[3*j+2] = cv::saturate_cast<uchar>(acc[2]);
+			}
+		}
+	});
+}
+
+// geometries kept by a MapCache
+#define MAP_CACHE_ENTRIES 16
+
+struct CachedMaps {
+	std::vector<int> key;
+	// CV_32FC1 maps, or with MAP_FIXED16 the packed map alone
+	cv::Mat map_x, map_y;
+	PackedMap packed;
+};
+
+class MapCache
+{
+public:
+	MapStorage storage = MAP_FLOAT;
+
+	const CachedMaps& get(int rotate_down, int outputw, int outputh, int srcw, int srch)
+	{
+		// the fisheye maps for these parameters, computed on first use
+		std::vector<int> key = { rotate_down, outputw, outputh, srcw, srch, (int)storage };
+		for (std::list<CachedMaps>::iterator it = entries.begin(); it != entries.end(); ++it) {
+			if (it->key == key) {
+				entries.splice(entries.begin(), entries, it);
+				return entries.front();
+			}
+		}
+		if (entries.size() >= MAP_CACHE_ENTRIES)
+			entries.pop_back();
+		entries.push_front(CachedMaps());
+		CachedMaps& maps = entries.front();
+		maps.key = key;
+		maps.map_x.create(outputh, outputw, CV_32FC1);
+		maps.map_y.create(outputh, outputw, CV_32FC1);
+		fisheyeMap(maps.map_x, maps.map_y, 0, outputw, outputh, rotate_down, srcw, srch);
+		if (storage == MAP_FIXED16) {
+			packMap(maps.map_x, maps.map_y, maps.packed);
+			maps.map_x.release();
+			maps.map_y.release();
+		}
+		return maps;
+	}
+
+private:
+	// most recently used first
+	std::list<CachedMaps> entries;
+};
+
+//////////////////////////////////////////////
+// Render workspace. Every render used to allocate its intermediates
+// afresh, and large allocations go straight to mmap, so each slider step
+// paid for the allocation and for faulting in zeroed pages. The workspace
+// keeps its Mats between calls, so same-sized renders write into the same
+// buffers, and its Mats are backed by an arena which keeps freed buffers
+// for reuse when the sizes change. The feather tables are kept too, and
+// the remap's per block maps by each thread. What still comes from the
+// heap on every render is small: the stage keys, the block lists of
+// remapTiled, and OpenCV's own temporaries, inside inpaint for example.
+
+// buffers are rounded up to this, so that slightly different sizes can share them
+#define ARENA_GRANULE (64*1024)
+// freed buffers kept beyond this are given back
+#define ARENA_MAX_FREE_BYTES ((size_t)256*1024*1024)
+
+class ArenaAllocator : public cv::MatAllocator
+{
+public:
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+		cv::AccessFlag, cv::UMatUsageFlags) const CV_OVERRIDE
+	{
+		// same layout as OpenCV's own StdMatAllocator
+		size_t total = CV_ELEM_SIZE(type);
+		for (int i = dims-1; i >= 0; i--) {
+			if (step) {
+				if (data0 && step[i] != CV_AUTOSTEP) {
+					CV_Assert(total <= step[i]);
+					total = step[i];
+				}
+				else {
+					step[i] = total;
+				}
+			}
+			total *= sizes[i];
+		}
+		std::lock_guard<std::mutex> lock(m);
+		cv::UMatData* u = newUMatData();
+		if (data0) {
+			u->data = u->origdata = (uchar*)data0;
+			u->flags |= cv::UMatData::USER_ALLOCATED;
+		}
+		else {
+			u->data = u->origdata = takeBlock(total);
+		}
+		u->size = total;
+		return u;
+	}
+
+	bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const CV_OVERRIDE
+	{
+		return u != NULL;
+	}
+
+	void deallocate(cv::UMatData* u) const CV_OVERRIDE
+	{
+		if (!u)
+			return;
+		CV_Assert(u->urefcount == 0);
+		CV_Assert(u->refcount == 0);
+		std::lock_guard<std::mutex> lock(m);
+		if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+			returnBlock(u->origdata);
+		// the UMatData headers are pooled too
+		u->~UMatData();
+		headers.push_back(u);
+	}
+
+private:
+	uchar* takeBlock(size_t total) const
+	{
+		// best fit among the free buffers, as long as it doesn't waste more than half
+		std::multimap<size_t, uchar*>::iterator it = freeblocks.lower_bound(total);
+		if (it != freeblocks.end() && it->first <= 2*total) {
+			uchar* p = it->second;
+			freebytes -= it->first;
+			freeblocks.erase(it);
+			return p;
+		}
+		size_t cap = (total + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+		uchar* p = (uchar*)cv::fastMalloc(cap);
+		capacity[p] = cap;
+		return p;
+	}
+
+	void returnBlock(uchar* p) const
+	{
+		std::map<uchar*, size_t>::iterator it = capacity.find(p);
+		CV_Assert(it != capacity.end());
+		if (freebytes + it->second > ARENA_MAX_FREE_BYTES) {
+			cv::fastFree(p);
+			capacity.erase(it);
+			return;
+		}
+		freebytes += it->second;
+		freeblocks.insert(std::make_pair(it->second, p));
+	}
+
+	cv::UMatData* newUMatData() const
+	{
+		void* mem;
+		if (!headers.empty()) {
+			mem = headers.back();
+			headers.pop_back();
+		}
+		else {
+			mem = ::operator new(sizeof(cv::UMatData));
+		}
+		return new (mem) cv::UMatData(this);
+	}
+
+	mutable std::mutex m;
+	// every buffer owned by the arena, with its real size
+	mutable std::map<uchar*, size_t> capacity;
+	// the ones not in use, by size
+	mutable std::multimap<size_t, uchar*> freeblocks;
+	mutable size_t freebytes = 0;
+	mutable std::vector<void*> headers;
+};
+
+ArenaAllocator* renderArena()
+{
+	// never destroyed, since Mats handed out to the caller may outlive any scope
+	static ArenaAllocator* arena = new ArenaAllocator();
+	return arena;
+}
+
+// the timed stages of equirectToFisheye
+enum RenderStage { STAGE_PLACEMENT, STAGE_RESIZE, STAGE_MAPS, STAGE_REMAP, STAGE_MASK, STAGE_INPAINT, RENDER_STAGES };
+
+const char* renderStageName(int stage)
+{
+	static const char* names[RENDER_STAGES] = { "placement", "resize", "maps", "remap", "mask", "inpaint" };
+	return names[stage];
+}
+
+static inline double msSince(int64 start)
+{
+	return (cv::getTickCount() - start) * 1000. / cv::getTickFrequency();
+}
+
+struct RenderWorkspace {
+	// the intermediates of one render pipeline. These must only be written
+	// through create(), copyTo() or as OpenCV outputs, since assigning
+	// another Mat to them would drop the arena.
+	cv::Mat sky, background, equirect, tmp;
+	cv::Mat map_x, map_y, dst_x, dst_y, res, dst;
+	cv::Mat mask, dst2;
+	// the feather tables of placePanAt, refilled in place
+	std::vector<ushort> colweights, rowweights, weighttab;
+	// the fisheye maps of the recent geometries
+	MapCache maps;
+
+	// With memoize, as for the preview, each stage of equirectToFisheye keeps its
+	// output together with the key of the inputs it was computed from, and is
+	// skipped while they are unchanged. The stages and what they depend on:
+	//	background	the source, skyrows, intermediate size -> sky stretched into background
+	//	pan		the source, extent, intermediate size -> tmp
+	//	placement	background, pan, movedown -> equirect
+	//	res		placement, outputw -> res
+	//	warp		res, rotate_down (the maps) -> dst
+	//	mask		outputw -> mask
+	//	inpaint		warp, mask -> dst2
+	// so rotate_down only reruns warp and inpaint, and move_down starts at placement.
+	// Without memoize, the sky is stretched straight into equirect, saving a buffer.
+	bool memoize = false;
+	std::vector<long long> backgroundkey, pankey, placekey, reskey, warpkey, maskkey, inpaintkey;
+	// milliseconds each stage took in the last render, 0 for the stages it skipped
+	double stagems[RENDER_STAGES];
+
+	RenderWorkspace()
+	{
+		std::fill(stagems, stagems + RENDER_STAGES, 0.);
+		cv::Mat* all[] = { &sky, &background, &equirect, &tmp, &map_x, &map_y, &dst_x, &dst_y, &res, &dst, &mask, &dst2 };
+		for (cv::Mat* mat : all)
+			mat->allocator = renderArena();
+	}
+
+	bool current(std::vector<long long>& stagekey, const std::vector<long long>& key)
+	{
+		// whether a stage's output is current for key. If not, the stage counts as
+		// not computed until done() is called for it, in case the render is cancelled
+		if (memoize && !key.empty() && stagekey == key) return true;
+		stagekey.clear();
+		return false;
+	}
+	void done(std::vector<long long>& stagekey, const std::vector<long long>& key)
+	{
+		if (memoize) stagekey = key;
+	}
+};
+
+std::vector<long long> stageKey(const std::vector<long long>& upstream, std::initializer_list<long long> params)
+{
+	// the key of a stage: the keys of the stages it reads, and its own parameters
+	std::vector<long long> key = upstream;
+	key.insert(key.end(), params);
+	return key;
+}
+
+std::vector<long long> sourceKey(const cv::Mat& source)
+{
+	return { (long long)(size_t)source.data, source.cols, source.rows, (long long)source.step[0], source.type() };
+}
+
+cv::Mat ocvwarp1(cv::Mat equirect, int rotate_down, int outputw, int outputh, RenderWorkspace& ws) {
+	// all the buffers are the workspace's, reused if the size is unchanged,
+	// and the maps are recomputed only when rotate_down changes.
+	// The stages are memoized only for the workspace's own equirect, whose placement is known.
+	std::vector<long long> reskey;
+	if (equirect.data == ws.equirect.data && !ws.placekey.empty())
+		reskey = stageKey(ws.placekey, { outputw, outputh });
+	std::vector<long long> warpkey;
+	if (!reskey.empty())
+		warpkey = stageKey(reskey, { rotate_down, (long long)ws.maps.storage });
+	if (ws.current(ws.warpkey, warpkey)) return ws.dst;
+	int64 start = cv::getTickCount();
+	const CachedMaps& maps = ws.maps.get(rotate_down, outputw, outputh, outputw, outputh);
+	ws.stagems[STAGE_MAPS] = msSince(start);
+	if (!ws.current(ws.reskey, reskey)) {
+		start = cv::getTickCount();
+		cv::resize( equirect, ws.res, cv::Size(outputw, outputh), 0, 0, cv::INTER_CUBIC);
+		ws.stagems[STAGE_RESIZE] = msSince(start);
+		ws.done(ws.reskey, reskey);
+	}
+	start = cv::getTickCount();
+	if (!maps.packed.xy.empty()) {
+		remapPacked(ws.res, ws.dst, maps.packed);
+	}
+	else if (outputw < REMAP_TILED_MIN && outputh < REMAP_TILED_MIN) {
+		cv::convertMaps(maps.map_x, maps.map_y, ws.dst_x, ws.dst_y, CV_16SC2);	// supposed to make it faster to remap
+		cv::remap( ws.res, ws.dst, ws.dst_x, ws.dst_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0) );
+	}
+	else {
+		// res is too big for the cache to hold the rows a row of output touches,
+		// or for 16 bit maps to address
+		remapTiled(ws.res, ws.dst, maps.map_x, maps.map_y, cv::INTER_LINEAR, cv::Scalar(0, 0, 0));
+	}
+	ws.stagems[STAGE_REMAP] = msSince(start);
+	ws.done(ws.warpkey, warpkey);
+	return ws.dst;
+
+}
+
+// fraction of the pan width (or height) over which a partial pan fades out
+#define FEATHER_FRACTION 0.05
+
+void featherWeights(std::vector<ushort>& w, int length, int featherw, bool fadestart, bool fadeend)
+{
+	// 1D weight table in 8.8 fixed point, 0 at a faded edge, 256 in the interior
+	// smoothstep ramp, so that the fade does not show a visible kink.
+	// w is refilled, reusing its storage
+	w.assign(length, 256);
+	featherw = std::min(featherw, length/2);
+	for (int k = 0; k < featherw; k++) {
+		float t = (k + 0.5f) / featherw;
+		ushort wk = (ushort)cvRound(256.f * t * t * (3.f - 2.f * t));
+		if (fadestart) w[k] = wk;
+		if (fadeend) w[length - 1 - k] = wk;
+	}
+}
+
+void featherBlend(const cv::Mat& src, cv::Mat dst, const std::vector<ushort>& colweights, const std::vector<ushort>& rowweights,
+	std::vector<ushort>& wtab)
+{
+	// places src over dst, weighted by colweights[x]*rowweights[y]
+	// this replaces the copyTo of the pan into the intermediate, so the fade costs no extra pass
+	// dst is a same-sized ROI of the intermediate, CV_8UC3 like src
+	int cn = src.channels();
+	int n = src.cols * cn;
+	// expand the column table per channel into wtab, so that the inner loop is a flat run of bytes
+	wtab.resize(n);
+	for (int x = 0; x < src.cols; x++)
+		for (int c = 0; c < cn; c++)
+			wtab[x*cn + c] = colweights[x];
+	cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range& range) {
+		// the row's weights, kept by each thread
+		static thread_local std::vector<ushort> wrow;
+		wrow.resize(n);
+		for (int y = range.start; y < range.end; y++) {
+			const uchar* s = src.ptr<uchar>(y);
+			uchar* d = dst.ptr<uchar>(y);
+			const int rw = rowweights[y];
+			if (rw == 0) continue;
+			const ushort* wt = wtab.data();
+			ushort* wr = wrow.data();
+			// simple fixed point loops, written so that the compiler auto-vectorizes them
+			for (int i = 0; i < n; i++)
+				wr[i] = (ushort)((wt[i] * rw) >> 8);
+			for (int i = 0; i < n; i++)
+				d[i] = (uchar)((s[i] * wr[i] + d[i] * (256 - wr[i]) + 128) >> 8);
+		}
+	});
+}
+
+cv::Size intermediateSize(int outputw)
 {
 	int equirectw = 8192;
 	int equirecth = 4096;
@@ -189,33 +809,92 @@ cv::Mat equirectToFisheye(cv::Mat inputMat, int sky_threshold, int horizontal_ex
 		equirectw=4096;
 		equirecth=2048;
 	}
-	// sky_threshold has a range 0 to 400. scaling this to 0 to Input Mat h
-	sky_threshold = (int)((float)inputMat.rows/400.)*sky_threshold;
+	return cv::Size(equirectw, equirecth);
+}
+
+struct PanPlacement {
+	// the slider values of placePan, scaled to pixels of the source and of the intermediate
+	cv::Size equirectsize;
+	int skyrows;
+	int extent;
+	int movedown;
+};
+
+PanPlacement panPlacement(cv::Size inputsize, int sky_threshold, int horizontal_extent, int move_down, int outputw)
+{
+	PanPlacement p;
+	p.equirectsize = intermediateSize(outputw);
+	int equirectw = p.equirectsize.width;
+	int equirecth = p.equirectsize.height;
+	// sky_threshold has a range 0 to 400. scaling this to 0 to Input Mat h,
+	// without truncating the scale, so that the preview proxy gets the same sky as the full image
+	sky_threshold = (int)((float)inputsize.height/400.*sky_threshold);
+	// For now, we take the sky to be the top 5 pixels of inputMat if sky_threshold is very small
+	p.skyrows = std::max(sky_threshold, 5);
 	// horizontal_extent has a range 0 to 360. scaling this to 0 to equirectw
 	// https://stackoverflow.com/questions/2745074/fast-ceiling-of-an-integer-division-in-c-c
-	horizontal_extent = ceil(((float)equirectw/360.)*(float)horizontal_extent);
+	p.extent = ceil(((float)equirectw/360.)*(float)horizontal_extent);
 	// move_down has a range 0 to 400. scaling this to 0 to half of equirecth
-	move_down = (int)((float)equirecth/800.)*move_down;
+	p.movedown = (int)((float)equirecth/800.)*move_down;
+	return p;
+}
+
+int placedPanWidth(int horizontal_extent, int outputw)
+{
+	// the width the pan is resized to in the intermediate, so the most of the source a render uses
+	return std::max(1, panPlacement(cv::Size(), 0, horizontal_extent, 0, outputw).extent);
+}
+
+PanPlacement halvedPlacement(const PanPlacement& p)
+{
+	// the same placement for a plane subsampled 2x in both directions, as JPEG chroma
+	PanPlacement h;
+	h.equirectsize = cv::Size(p.equirectsize.width / 2, p.equirectsize.height / 2);
+	h.skyrows = (p.skyrows + 1) / 2;
+	h.extent = (p.extent + 1) / 2;
+	h.movedown = p.movedown / 2;
+	return h;
+}
+
+cv::Mat placePanAt(cv::Mat inputMat, const PanPlacement& placement, RenderWorkspace& ws)
+{
+	// builds the intermediate equirect image, with the stretched sky
+	// and the resized pan placed in it. inputMat may have 1 or 3 channels.
+	cv::Size equirectsize = placement.equirectsize;
+	int equirectw = equirectsize.width;
+	int horizontal_extent = placement.extent;
+	int move_down = placement.movedown;
 	
-	cv::Mat dst, dst2, tmp, tmpcropped, sky, equirect;
-	cv::Size dstsize = cv::Size(outputw,outputw);
-	// for testing large Mat, 
-	cv::Size equirectsize = cv::Size(equirectw,equirecth);
+	cv::Mat& tmp = ws.tmp;
+	cv::Mat& sky = ws.sky;
+	cv::Mat& equirect = ws.equirect;
+	cv::Mat tmpcropped;
+	const std::vector<long long> source = sourceKey(inputMat);
+	const std::vector<long long> backgroundkey = stageKey(source, { placement.skyrows, equirectsize.width, equirectsize.height });
+	const std::vector<long long> pankey = stageKey(source, { horizontal_extent, equirectsize.width, equirectsize.height });
+	std::vector<long long> placekey = stageKey(backgroundkey, { horizontal_extent, move_down });
+	if (ws.current(ws.placekey, placekey)) return equirect;
 	// initialize dst with the same datatype as inputMat
 	// cv::resize(inputMat, dst, dstsize, 0, 0, cv::INTER_CUBIC);
 	// with the "sky" region stretched to fit
-	// For now, we take the sky to be the top 5 pixels of inputMat if sky_threshold is very small
-	if (sky_threshold < 5) {
-		inputMat.rowRange(0,5).copyTo(sky);
+	if (!ws.memoize) {
+		inputMat.rowRange(0,std::min(placement.skyrows, inputMat.rows)).copyTo(sky);
+		cv::resize(sky, equirect, equirectsize, 0, 0, cv::INTER_LINEAR);
 	}
 	else {
-		inputMat.rowRange(0,sky_threshold).copyTo(sky);
+		if (!ws.current(ws.backgroundkey, backgroundkey)) {
+			inputMat.rowRange(0,std::min(placement.skyrows, inputMat.rows)).copyTo(sky);
+			cv::resize(sky, ws.background, equirectsize, 0, 0, cv::INTER_LINEAR);
+			ws.done(ws.backgroundkey, backgroundkey);
+		}
+		ws.background.copyTo(equirect);
 	}
-	cv::resize(sky, dst, dstsize, 0, 0, cv::INTER_LINEAR);
-	cv::resize(sky, equirect, equirectsize, 0, 0, cv::INTER_LINEAR);
 	// we want the tmp to contain the inputMat without any distortion, 
 	// resized with x/y aspect ratio unchanged.
-	cv::resize(inputMat, tmp, cv::Size(horizontal_extent, ceil(inputMat.rows*(float)horizontal_extent/(float)inputMat.cols)), 0, 0, cv::INTER_CUBIC);
+	if (!ws.current(ws.pankey, pankey)) {
+		cv::resize(inputMat, tmp, cv::Size(horizontal_extent, ceil(inputMat.rows*(float)horizontal_extent/(float)inputMat.cols)), 0, 0, cv::INTER_CUBIC);
+		ws.done(ws.pankey, pankey);
+	}
 	//tmp.rowRange(1, outputw-sky_threshold).copyTo(dst.rowRange(sky_threshold+1, outputw));
 	int x =  (int)(equirectw-horizontal_extent)/2;
 	int y =  move_down;
@@ -230,110 +909,2274 @@ cv::Mat equirectToFisheye(cv::Mat inputMat, int sky_threshold, int horizontal_ex
 		
 	if (x<2) { x=0;}
 	if (y<(inputMat.rows-2)) {// otherwise don't copy, since tmp may be too small
-		tmpcropped.copyTo(equirect(cv::Rect(x,y,tmpcropped.cols, tmpcropped.rows)));
+		// automatic fadeouts at the left and right edges if pan is not 360 degrees,
+		// and at the bottom edge if the pan does not reach the bottom of the intermediate
+		bool partialpan = tmpcropped.cols < equirect.cols;
+		bool bottomedge = (y + tmpcropped.rows) < equirect.rows;
+		if (partialpan || bottomedge) {
+			featherWeights(ws.colweights, tmpcropped.cols, (int)(FEATHER_FRACTION*tmpcropped.cols), partialpan, partialpan);
+			featherWeights(ws.rowweights, tmpcropped.rows, (int)(FEATHER_FRACTION*tmpcropped.rows), false, bottomedge);
+			featherBlend(tmpcropped, equirect(cv::Rect(x,y,tmpcropped.cols, tmpcropped.rows)), ws.colweights, ws.rowweights, ws.weighttab);
+		}
+		else {
+			tmpcropped.copyTo(equirect(cv::Rect(x,y,tmpcropped.cols, tmpcropped.rows)));
+		}
 	}
-	// the equirectToFisheye is done here
-	dst = ocvwarp1(equirect, rotate_down, outputw, outputw);
-	// "horiz extent" would determine the "zoom" level
-	// "rotate_down" would determine the angle tilt above or below the horizon
-	// before returning dst, we want to clean up the seam, using inpainting
-	// first create and initialize a mask, needs to be 8 bit 1 channel
-	cv::Mat mask(dstsize, CV_8UC1, cv::Scalar(0));
+	ws.done(ws.placekey, placekey);
+	return equirect;
+}
+
+cv::Mat placePan(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int outputw, RenderWorkspace& ws)
+{
+	// the intermediate for an output of width outputw
+	return placePanAt(inputMat, panPlacement(inputMat.size(), sky_threshold, horizontal_extent, move_down, outputw), ws);
+}
+
+cv::Mat placePan(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int outputw)
+{
+	RenderWorkspace ws;
+	return placePan(inputMat, sky_threshold, horizontal_extent, move_down, outputw, ws);
+}
+
+void seamMask(cv::Mat& mask, int outputw, int firstrow, int firstcol = 0)
+{
+	// marks the seam to be inpainted, for the rows firstrow to firstrow+mask.rows
+	// and the columns firstcol to firstcol+mask.cols of the output
+	// mask needs to be 8 bit 1 channel, and initialized to 0
 	// todo calculate the correct polynomial vertices [160,130],[350,130],[250,300]
 	// width 10% of outputw, height 50% of outputw
-	try {
-	std::vector<cv::Point> my_poly = {cv::Point(outputw/2 - outputw/20,outputw), cv::Point(outputw/2 + outputw/20,outputw), cv::Point(outputw/2 + outputw/20,outputw/2), cv::Point(outputw/2 - outputw/20,outputw/2)};
+	//std::vector<cv::Point> my_poly = {cv::Point(outputw/2 - outputw/20,outputw), cv::Point(outputw/2 + outputw/20,outputw), cv::Point(outputw/2 + outputw/20,outputw/2), cv::Point(outputw/2 - outputw/20,outputw/2)};
 	//cv::fillPoly(InputOutputArray img, InputArrayOfArrays pts, const Scalar & color)	
 	//cv::fillPoly(mask, my_poly, cv::Scalar::all(255));
 	// void cv::rectangle(InputOutputArray img, Point pt1, Point pt2, const Scalar & color)
 	// opencv has x=0,y=0 at top left 
-	cv::rectangle(mask, cv::Point(outputw/2 - outputw/4,0), cv::Point(outputw/2 + outputw/4,outputw/2), cv::Scalar(255) );
-	std::cout << "Created mask!" << std::endl;
-	} catch (...) {
-		std::cout << "Exception occurred in creating mask!" << std::endl;
-		return dst;
+	cv::rectangle(mask, cv::Point(outputw/2 - outputw/4-firstcol,0-firstrow), cv::Point(outputw/2 + outputw/4-firstcol,outputw/2-firstrow), cv::Scalar(255) );
+}
+
+cv::Mat equirectToFisheye(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int rotate_down, int outputw, RenderWorkspace& ws,
+	bool inpaint = true, std::function<bool()> cancelled = nullptr)
+{
+	// without inpaint, the seam is left as it is, for quick drafts.
+	// cancelled, if given, is checked between stages, and an empty Mat is returned once it is true
+	cv::Mat dst, equirect;
+	cv::Size dstsize = cv::Size(outputw,outputw);
+	std::fill(ws.stagems, ws.stagems + RENDER_STAGES, 0.);
+	int64 start = cv::getTickCount();
+	equirect = placePan(inputMat, sky_threshold, horizontal_extent, move_down, outputw, ws);
+	ws.stagems[STAGE_PLACEMENT] = msSince(start);
+	if (cancelled && cancelled()) return cv::Mat();
+	// the equirectToFisheye is done here
+	dst = ocvwarp1(equirect, rotate_down, outputw, outputw, ws);
+	if (cancelled && cancelled()) return cv::Mat();
+	if (!inpaint) return dst;
+	// "horiz extent" would determine the "zoom" level
+	// "rotate_down" would determine the angle tilt above or below the horizon
+	// before returning dst, we want to clean up the seam, using inpainting
+	// first create and initialize a mask, needs to be 8 bit 1 channel
+	const std::vector<long long> maskkey = { outputw };
+	std::vector<long long> inpaintkey;
+	if (!ws.warpkey.empty())
+		inpaintkey = stageKey(ws.warpkey, { outputw });
+	if (ws.current(ws.inpaintkey, inpaintkey)) return ws.dst2;
+	if (!ws.current(ws.maskkey, maskkey)) {
+		start = cv::getTickCount();
+		ws.mask.create(dstsize, CV_8UC1);
+		ws.mask.setTo(cv::Scalar(0));
+		try {
+		seamMask(ws.mask, outputw, 0);
+		std::cout << "Created mask!" << std::endl;
+		} catch (...) {
+			std::cout << "Exception occurred in creating mask!" << std::endl;
+			return dst;
+		}
+		ws.stagems[STAGE_MASK] = msSince(start);
+		ws.done(ws.maskkey, maskkey);
 	}
+	if (cancelled && cancelled()) return cv::Mat();
+	start = cv::getTickCount();
 	try {
-	cv::inpaint(dst, mask, dst2, 3, cv::INPAINT_TELEA);
+	cv::inpaint(dst, ws.mask, ws.dst2, 3, cv::INPAINT_TELEA);
 	std::cout << "Inpainting done!" << std::endl;
 	} catch (...) {
 		std::cout << "Exception occurred in inpaint!" << std::endl;
 		return dst;
 	}
-	return dst2;
+	ws.stagems[STAGE_INPAINT] = msSince(start);
+	ws.done(ws.inpaintkey, inpaintkey);
+	return ws.dst2;
 }
 
+// rows of overlap between bands, so that the inpainting of the seam
+// sees the same neighbourhood as it would in the full frame
+#define BAND_OVERLAP 8
+// outputs at least this wide are rendered in bands when saving
+#define BANDED_RENDER_MIN_WIDTH 8192
+#define BAND_HEIGHT 256
 
-cv::Mat simplePolar(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int outputw)
-{
-	// sky_threshold has a range 0 to 400. scaling this to 0 to outputw
-	sky_threshold = (int)((float)outputw/400.)*sky_threshold;
-	// horizontal_extent has a range 1 to 360. scaling this to 0 to outputw
-	horizontal_extent = (int)((float)outputw/360.)*horizontal_extent;
-	cv::Mat dst, tmp, sky;
-	cv::Size dstsize = cv::Size(outputw,outputw);
-	// initialize dst with the same datatype as inputMat
-	// cv::resize(inputMat, dst, dstsize, 0, 0, cv::INTER_CUBIC);
-	// with the "sky" region stretched to fit
-	// For now, we take the sky to be the top 5 pixels of inputMat
-	inputMat.rowRange(1,5).copyTo(sky);
-	cv::resize(sky, dst, dstsize, 0, 0, cv::INTER_CUBIC);
+//////////////////////////////////////////////
+// Mip-mapped sampling of the intermediate. Near the zenith the fisheye
+// squeezes many intermediate pixels into one output pixel, and plain
+// bilinear or cubic sampling aliases there. Each output pixel instead gets
+// a level of detail from its map's Jacobian, and is sampled trilinearly
+// from a pyramid of the intermediate.
 
-	cv::resize(inputMat, tmp, cv::Size(horizontal_extent, outputw-sky_threshold), 0, 0, cv::INTER_CUBIC);
-	//tmp.rowRange(1, outputw-sky_threshold).copyTo(dst.rowRange(sky_threshold+1, outputw));
-	int x =  (int)(outputw-horizontal_extent)/2;
-	int y =  sky_threshold;
-	if (x<2) { x=0;}
-	if (y<398) {// otherwise don't copy, since tmp may be too small
-	tmp.copyTo(dst(cv::Rect(x,y,tmp.cols, tmp.rows)));
+struct SourcePyramid {
+	// the intermediate and its mip levels, kept between renders with the same placement
+	std::vector<size_t> key;
+	std::vector<cv::Mat> levels;
+};
+
+void addMipLevels(std::vector<cv::Mat>& levels)
+{
+	// halves levels[0] down to about 16 rows
+	while (levels.back().rows >= 16) {
+		cv::Mat next;
+		cv::pyrDown(levels.back(), next);
+		levels.push_back(next);
 	}
-	
-	cv::Point2f centrepoint( (float)dst.cols / 2, (float)dst.rows / 2 );
-	double maxRadius = (double)dst.cols / 2;
-	    
-	int flags = cv::INTER_CUBIC + cv::WARP_FILL_OUTLIERS + cv::WARP_INVERSE_MAP;
-	cv::rotate(dst, dst, cv::ROTATE_90_COUNTERCLOCKWISE);
-	// this rotate is needed, since opencv's warpPolar() is written that way
-	
-	cv::warpPolar(dst, dst, dstsize, centrepoint, maxRadius, flags);
-		    // one more rotate is needed
-	cv::rotate(dst, dst, cv::ROTATE_90_COUNTERCLOCKWISE);
-	return dst;
 }
-	
 
-std::string escaped(const std::string& input)
+void buildPyramid(SourcePyramid& pyramid, cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int outputw)
 {
-	// https://stackoverflow.com/questions/48260879/how-to-replace-with-in-c-string
-	// needed for windows paths for opencv
-	std::string output;
-	output.reserve(input.size());
-	for (const char c: input) {
-		switch (c) {
-		    case '\a':  output += "\\a";        break;
-		    case '\b':  output += "\\b";        break;
-		    case '\f':  output += "\\f";        break;
-		    case '\n':  output += "\\n";        break;
-		    case '\r':  output += "\\r";        break;
-		    case '\t':  output += "\\t";        break;
-		    case '\v':  output += "\\v";        break;
-		    default:    output += c;            break;
+	// does nothing if the pyramid was already built from the same input and placement
+	std::vector<size_t> key = { (size_t)inputMat.data, (size_t)inputMat.cols, (size_t)inputMat.rows,
+		(size_t)sky_threshold, (size_t)horizontal_extent, (size_t)move_down, (size_t)outputw };
+	if (key == pyramid.key) return;
+	pyramid.levels.clear();
+	pyramid.levels.push_back(placePan(inputMat, sky_threshold, horizontal_extent, move_down, outputw));
+	addMipLevels(pyramid.levels);
+	pyramid.key = key;
+}
+
+void mipSample(const std::vector<cv::Mat>& levels, const cv::Mat& map_x, const cv::Mat& map_y, cv::Mat& dst, float border = 0.f)
+{
+	// map_x, map_y are CV_32FC1 coordinates into levels[0], dst becomes CV_8UC3 or CV_8UC1 like the levels.
+	// Outside the levels, dst gets border
+	const int cn = levels[0].channels();
+	dst.create(map_x.size(), CV_8UC(cn));
+	const float srcw = (float)levels[0].cols;
+	const float maxlod = (float)(levels.size() - 1);
+	cv::parallel_for_(cv::Range(0, map_x.rows), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++) {
+			// forward differences, backward at the last row and column
+			int ni = (i + 1 < map_x.rows) ? i + 1 : i - 1;
+			const float* mx = map_x.ptr<float>(i);
+			const float* my = map_y.ptr<float>(i);
+			const float* mxn = map_x.ptr<float>(ni);
+			const float* myn = map_y.ptr<float>(ni);
+			uchar* d = dst.ptr<uchar>(i);
+			for (int j = 0; j < map_x.cols; j++) {
+				int nj = (j + 1 < map_x.cols) ? j + 1 : j - 1;
+				float dux = mx[nj] - mx[j], dvx = my[nj] - my[j];
+				float duy = mxn[j] - mx[j], dvy = myn[j] - my[j];
+				// the map jumps by the full width across the longitude seam
+				if (std::abs(dux) > srcw/2) dux = srcw - std::abs(dux);
+				if (std::abs(duy) > srcw/2) duy = srcw - std::abs(duy);
+				float rho2 = std::max(dux*dux + dvx*dvx, duy*duy + dvy*dvy);
+				float lod = rho2 > 1.f ? 0.5f * std::log2(rho2) : 0.f;
+				lod = std::min(lod, maxlod);
+				int l0 = (int)lod;
+				float f = lod - l0;
+				float acc[3] = { 0.f, 0.f, 0.f };
+				// pixel centres of level l are at (x + 0.5) / 2^l - 0.5
+				float s0 = 1.f / (float)(1 << l0);
+				bilinearTap(levels[l0], (mx[j] + 0.5f) * s0 - 0.5f, (my[j] + 0.5f) * s0 - 0.5f, 1.f - f, acc, border);
+				if (f > 0.f && l0 + 1 < (int)levels.size()) {
+					float s1 = s0 * 0.5f;
+					bilinearTap(levels[l0 + 1], (mx[j] + 0.5f) * s1 - 0.5f, (my[j] + 0.5f) * s1 - 0.5f, f, acc, border);
+				}
+				for (int c = 0; c < cn; c++)
+					d[cn*j + c] = cv::saturate_cast<uchar>(acc[c]);
+			}
 		}
+	});
+}
+
+bool equirectToFisheyeBanded(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int rotate_down, int outputw, int bandh,
+	SourcePyramid* pyramid, std::function<bool(const cv::Mat& band, int firstrow)> writeband,
+	std::function<bool()> cancelled = nullptr)
+{
+	// same output as equirectToFisheye, but generated one band of bandh rows at a time,
+	// so peak memory is set by the band height and the intermediate, not by outputw*outputw.
+	// Instead of resizing the intermediate to outputw x outputw and remapping that,
+	// the maps point directly into the intermediate, with cubic interpolation,
+	// or mip-mapped if a pyramid is given, which is then kept for the next render.
+	// Each finished band is handed to writeband, which returns false to stop.
+	// If cancelled is given, it is also asked before the placement and before each band.
+	RenderWorkspace ws;
+	cv::Mat equirect;
+	if (cancelled && cancelled()) {
+		return false;
 	}
-	return output;
+	if (pyramid) {
+		buildPyramid(*pyramid, inputMat, sky_threshold, horizontal_extent, move_down, outputw);
+		equirect = pyramid->levels[0];
+	}
+	else {
+		equirect = placePan(inputMat, sky_threshold, horizontal_extent, move_down, outputw, ws);
+	}
+	// the band buffers are created once and reused for every band
+	cv::Mat& map_x = ws.map_x;
+	cv::Mat& map_y = ws.map_y;
+	cv::Mat& band = ws.dst;
+	cv::Mat& mask = ws.mask;
+	cv::Mat& band2 = ws.dst2;
+	for (int y0 = 0; y0 < outputw; y0 += bandh) {
+		if (cancelled && cancelled()) {
+			return false;
+		}
+		int y1 = std::min(y0 + bandh, outputw);
+		// rows actually rendered, including the overlap
+		int r0 = std::max(y0 - BAND_OVERLAP, 0);
+		int r1 = std::min(y1 + BAND_OVERLAP, outputw);
+		map_x.create(r1 - r0, outputw, CV_32FC1);
+		map_y.create(r1 - r0, outputw, CV_32FC1);
+		fisheyeMap(map_x, map_y, r0, outputw, outputw, rotate_down, equirect.cols, equirect.rows);
+		if (pyramid) {
+			mipSample(pyramid->levels, map_x, map_y, band);
+		}
+		else {
+			remapTiled(equirect, band, map_x, map_y, cv::INTER_CUBIC, cv::Scalar(0, 0, 0));
+		}
+		mask.create(band.size(), CV_8UC1);
+		mask = cv::Scalar(0);
+		seamMask(mask, outputw, r0);
+		try {
+			cv::inpaint(band, mask, band2, 3, cv::INPAINT_TELEA);
+		} catch (...) {
+			std::cout << "Exception occurred in inpaint!" << std::endl;
+			band.copyTo(band2);
+		}
+		if (!writeband(band2.rowRange(y0 - r0, y1 - r0), y0)) {
+			return false;
+		}
+	}
+	return true;
 }
 
-int main(int argc,char *argv[])
+cv::Mat equirectToFisheyeRoi(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int move_down, int rotate_down, int outputw,
+	cv::Rect roi, RenderWorkspace& ws, SourcePyramid* pyramid = NULL)
 {
-bool doneflag = 0;
-bool showdisplay = 1, interactivemode=0;
-bool skipinputs = 0;
-int outputw;
-std::string PanFileName;
-std::string NAME;
-float aspectratio[100];
-int looptemp=0;
-std::string escapedpath;
+	// just the rectangle roi of the outputw x outputw fisheye, rendered as equirectToFisheyeBanded
+	// would: the maps of roi only, sampled straight from the intermediate, or mip-mapped if
+	// a pyramid is given, and the seam inpainted only around roi. With a memoized ws, or
+	// the pyramid, the placement is kept for the next roi.
+	// The result is a view into ws, valid until its next render.
+	roi &= cv::Rect(0, 0, outputw, outputw);
+	if (roi.empty()) return cv::Mat();
+	cv::Mat equirect;
+	if (pyramid) {
+		buildPyramid(*pyramid, inputMat, sky_threshold, horizontal_extent, move_down, outputw);
+		equirect = pyramid->levels[0];
+	}
+	else {
+		equirect = placePan(inputMat, sky_threshold, horizontal_extent, move_down, outputw, ws);
+	}
+	// the buffers below hold the outputs of the later stages otherwise
+	ws.reskey.clear();
+	ws.warpkey.clear();
+	ws.maskkey.clear();
+	ws.inpaintkey.clear();
+	// rendered with the same overlap as bands, so that the inpainting sees the seam's surroundings
+	cv::Rect r = cv::Rect(roi.x - BAND_OVERLAP, roi.y - BAND_OVERLAP, roi.width + 2*BAND_OVERLAP, roi.height + 2*BAND_OVERLAP)
+		& cv::Rect(0, 0, outputw, outputw);
+	ws.map_x.create(r.size(), CV_32FC1);
+	ws.map_y.create(r.size(), CV_32FC1);
+	fisheyeMap(ws.map_x, ws.map_y, r.y, outputw, outputw, rotate_down, equirect.cols, equirect.rows, r.x);
+	if (pyramid) {
+		mipSample(pyramid->levels, ws.map_x, ws.map_y, ws.dst);
+	}
+	else {
+		remapTiled(equirect, ws.dst, ws.map_x, ws.map_y, cv::INTER_CUBIC, cv::Scalar(0, 0, 0));
+	}
+	ws.mask.create(r.size(), CV_8UC1);
+	ws.mask = cv::Scalar(0);
+	seamMask(ws.mask, outputw, r.y, r.x);
+	cv::Rect inner = cv::Rect(roi.x - r.x, roi.y - r.y, roi.width, roi.height);
+	if (cv::countNonZero(ws.mask) == 0) return ws.dst(inner);
+	try {
+		cv::inpaint(ws.dst, ws.mask, ws.dst2, 3, cv::INPAINT_TELEA);
+	} catch (...) {
+		std::cout << "Exception occurred in inpaint!" << std::endl;
+		return ws.dst(inner);
+	}
+	return ws.dst2(inner);
+}
+
+//////////////////////////////////////////////
+// YCbCr 4:2:0 path. JPEGs are almost always stored as full resolution
+// luma and half resolution chroma, so instead of decoding to BGR, warping
+// three full resolution channels and converting back to encode, the
+// planes are warped as they are: luma with the fisheye map, chroma with
+// that map decimated 2x2, and handed to the encoder without any colour
+// conversion. That is about half the remap work and memory traffic.
+
+void decimateMap(const cv::Mat& map_x, const cv::Mat& map_y, int firstrow, int srcw,
+	cv::Mat& cmap_x, cv::Mat& cmap_y, int cfirstrow, int crows, int ccols)
+{
+	// the map of the chroma rows cfirstrow to cfirstrow+crows, from the luma map of
+	// the rows firstrow onwards. Each chroma sample sits at the centre of its 2x2 luma
+	// samples, so it takes the mean of their coordinates, halved into the chroma plane.
+	// Across the longitude seam the four disagree by about srcw, and the first one is used.
+	cmap_x.create(crows, ccols, CV_32FC1);
+	cmap_y.create(crows, ccols, CV_32FC1);
+	for (int i = 0; i < crows; i++) {
+		int y0 = 2*(cfirstrow + i) - firstrow;
+		int y1 = std::min(y0 + 1, map_x.rows - 1);
+		const float* x0row = map_x.ptr<float>(y0);
+		const float* x1row = map_x.ptr<float>(y1);
+		const float* y0row = map_y.ptr<float>(y0);
+		const float* y1row = map_y.ptr<float>(y1);
+		float* cx = cmap_x.ptr<float>(i);
+		float* cy = cmap_y.ptr<float>(i);
+		for (int j = 0; j < ccols; j++) {
+			int j0 = 2*j, j1 = std::min(2*j + 1, map_x.cols - 1);
+			float xs[4] = { x0row[j0], x0row[j1], x1row[j0], x1row[j1] };
+			float lx = 0.25f * (xs[0] + xs[1] + xs[2] + xs[3]);
+			float ly = 0.25f * (y0row[j0] + y0row[j1] + y1row[j0] + y1row[j1]);
+			float lo = std::min(std::min(xs[0], xs[1]), std::min(xs[2], xs[3]));
+			float hi = std::max(std::max(xs[0], xs[1]), std::max(xs[2], xs[3]));
+			if (hi - lo > srcw / 2) lx = xs[0];
+			cx[j] = (lx + 0.5f) * 0.5f - 0.5f;
+			cy[j] = (ly + 0.5f) * 0.5f - 0.5f;
+		}
+	}
+}
+
+bool equirectToFisheyeBandedYcc(const cv::Mat planes[3], int sky_threshold, int horizontal_extent, int move_down, int rotate_down,
+	int outputw, int bandh, bool mipmap, std::function<bool(const cv::Mat bands[3], int firstrow)> writeband)
+{
+	// equirectToFisheyeBanded for the planes Y, Cb, Cr of a 4:2:0 image, planes[1] and [2]
+	// being half the size of planes[0]. Each band of bandh (even) output rows is handed to
+	// writeband as luma rows and the bandh/2 chroma rows under them.
+	PanPlacement placement[3];
+	placement[0] = panPlacement(planes[0].size(), sky_threshold, horizontal_extent, move_down, outputw);
+	placement[1] = placement[2] = halvedPlacement(placement[0]);
+	RenderWorkspace ws[3];
+	std::vector<cv::Mat> levels[3];
+	for (int c = 0; c < 3; c++) {
+		levels[c].push_back(placePanAt(planes[c], placement[c], ws[c]));
+		if (mipmap) addMipLevels(levels[c]);
+	}
+	const int equirectw = levels[0][0].cols, equirecth = levels[0][0].rows;
+	const int coutputw = (outputw + 1) / 2;
+	cv::Mat map_x, map_y, cmap_x, cmap_y;
+	cv::Mat band[3], mask[3], band2[3], out[3];
+	for (int y0 = 0; y0 < outputw; y0 += bandh) {
+		int y1 = std::min(y0 + bandh, outputw);
+		// rows actually rendered, including the overlap, kept even for the chroma
+		int r0 = std::max(y0 - BAND_OVERLAP, 0);
+		int r1 = std::min(y1 + BAND_OVERLAP, outputw);
+		map_x.create(r1 - r0, outputw, CV_32FC1);
+		map_y.create(r1 - r0, outputw, CV_32FC1);
+		fisheyeMap(map_x, map_y, r0, outputw, outputw, rotate_down, equirectw, equirecth);
+		decimateMap(map_x, map_y, r0, equirectw, cmap_x, cmap_y, r0 / 2, (r1 + 1) / 2 - r0 / 2, coutputw);
+		for (int c = 0; c < 3; c++) {
+			const cv::Mat& mx = c ? cmap_x : map_x;
+			const cv::Mat& my = c ? cmap_y : map_y;
+			if (mipmap) {
+				mipSample(levels[c], mx, my, band[c], c ? 128.f : 0.f);
+			}
+			else {
+				remapTiled(levels[c][0], band[c], mx, my, cv::INTER_CUBIC, cv::Scalar(c ? 128 : 0));
+			}
+			int w = c ? coutputw : outputw;
+			int first = c ? r0 / 2 : r0;
+			mask[c].create(band[c].size(), CV_8UC1);
+			mask[c] = cv::Scalar(0);
+			seamMask(mask[c], w, first);
+			try {
+				cv::inpaint(band[c], mask[c], band2[c], 3, cv::INPAINT_TELEA);
+			} catch (...) {
+				std::cout << "Exception occurred in inpaint!" << std::endl;
+				band[c].copyTo(band2[c]);
+			}
+			int from = c ? y0 / 2 : y0;
+			int to = c ? (y1 + 1) / 2 : y1;
+			out[c] = band2[c].rowRange(from - first, to - first);
+		}
+		if (!writeband(out, y0)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////
+// Peak memory estimates, so that a render which would not fit in the
+// memory budget can be refused before anything large is allocated
+
+enum RenderMode {
+	RENDER_FULL,		// equirectToFisheye, then cv::imwrite
+	RENDER_BANDED,		// equirectToFisheyeBanded, bands collected and written with cv::imwrite
+	RENDER_STREAMED		// equirectToFisheyeBanded, bands streamed to libjpeg / libpng
+};
+
+const char* renderModeName(RenderMode mode)
+{
+	switch (mode) {
+		case RENDER_FULL:	return "full frame";
+		case RENDER_BANDED:	return "banded";
+		default:		return "banded and streamed";
+	}
+}
+
+size_t estimatePeakBytes(cv::Size srcsize, int outputw, RenderMode mode, int bandh, bool mipmap)
+{
+	// peak bytes for rendering outputw x outputw from a decoded source of srcsize,
+	// adding up the buffers allocated in placePan, ocvwarp1, equirectToFisheye,
+	// equirectToFisheyeBanded and saveFisheyeYcc, what the writer holds,
+	// and the freed buffers the render arena keeps
+	const size_t src = (size_t)srcsize.width * srcsize.height * 3;
+	const cv::Size e = intermediateSize(outputw);
+	const size_t equirect = (size_t)e.width * e.height * 3;
+	const size_t o = (size_t)outputw * outputw;
+	// placePan: the sky rows (at most the whole source), the stretched sky,
+	// and the pan resized to the intermediate width
+	size_t tmp = 0;
+	if (srcsize.width > 0) tmp = (size_t)e.width * ((size_t)srcsize.height * e.width / srcsize.width) * 3;
+	size_t peak = src + src + equirect + tmp;
+	// the sky rows and the resized pan, which the workspace keeps while it renders
+	const size_t placement = src + tmp;
+	if (mode == RENDER_FULL) {
+		// ocvwarp1: float maps 8, CV_16SC2 + CV_16UC1 maps 6, res 3 and dst 3 bytes per output pixel,
+		// then the seam fix: dst 3, mask 1, dst2 3, and about 12 for cv::inpaint's own buffers,
+		// and cv::imwrite's encoder, taken as another copy of the output
+		peak = std::max(peak, src + placement + equirect + o * std::max(8 + 6 + 3 + 3, 3 + 1 + 3 + 12 + 3));
+	}
+	else {
+		// pyrDown levels add a third to the intermediate
+		size_t pyramid = mipmap ? equirect / 3 : 0;
+		// per band, including the overlap: float maps 8, band 3, mask 1, band2 3, inpaint 12
+		size_t rows = (size_t)std::min(bandh + 2*BAND_OVERLAP, outputw);
+		size_t band = rows * outputw * (8 + 3 + 1 + 3 + 12);
+		size_t writer;
+		if (mode == RENDER_BANDED) {
+			// the collected output, and cv::imwrite's encoder
+			writer = o * 3 * 2;
+		}
+		else {
+			// two queued strips and the one being encoded
+			writer = (size_t)3 * bandh * outputw * 3;
+		}
+		// mip-mapped, the placement is built in a workspace of its own, which is freed
+		size_t kept = mipmap ? 0 : placement;
+		peak = std::max(peak, src + kept + equirect + pyramid + band + writer);
+		if (mode == RENDER_STREAMED) {
+			// JPEG to JPEG, saveFisheyeYcc decodes the Y, Cb and Cr planes, 1.5 bytes per
+			// source pixel, beside the decoded source, and places and renders each plane
+			// as above, which comes to half the bytes. Per band, the luma float maps 8
+			// and the chroma maps 2 bytes per output pixel, with half the band buffers
+			size_t yccband = rows * outputw * (8 + 2 + (3 + 1 + 3 + 12) / 2);
+			peak = std::max(peak, src + src / 2 + (placement + equirect + pyramid) / 2 + yccband + writer);
+		}
+	}
+	// the arena keeps up to ARENA_MAX_FREE_BYTES of freed buffers, never more than was allocated
+	peak += std::min(peak, ARENA_MAX_FREE_BYTES);
+	return peak;
+}
+
+size_t estimateLoupeBytes(int outputw)
+{
+	// what the loupe keeps while it is open: its placement at the full intermediate
+	// size, with the stretched sky and the resized pan, or mip-mapped, the pyramid
+	// and the placement it is built from, about three intermediates either way
+	const cv::Size e = intermediateSize(outputw);
+	return (size_t)e.width * e.height * 3 * 3;
+}
+
+bool fitSaveMode(cv::Size srcsize, int outputw, size_t budget, bool canstream, bool mipmap, RenderMode& mode, int& bandh)
+{
+	// picks the render mode for saving, banded and streamed when the format allows it,
+	// with the band height halved until the estimate fits in budget (0 for no budget)
+	mode = canstream ? RENDER_STREAMED : RENDER_BANDED;
+	for (bandh = BAND_HEIGHT; bandh >= 32; bandh /= 2) {
+		if (budget == 0 || estimatePeakBytes(srcsize, outputw, mode, bandh, mipmap) <= budget) {
+			return true;
+		}
+	}
+	bandh = BAND_HEIGHT;
+	return false;
+}
+
+bool saveRendersFull(cv::Size srcsize, int outputw, size_t budget, bool mipmap)
+{
+	// whether a save renders the whole frame with equirectToFisheye, as it did before
+	// the banded render: below BANDED_RENDER_MIN_WIDTH, when that fits in budget,
+	// and not mip-mapped, which only the banded render does
+	return !mipmap && outputw < BANDED_RENDER_MIN_WIDTH
+		&& (budget == 0 || estimatePeakBytes(srcsize, outputw, RENDER_FULL, BAND_HEIGHT, false) <= budget);
+}
+
+cv::Mat simplePolar(cv::Mat inputMat, int sky_threshold, int horizontal_extent, int outputw)
+{
+	// sky_threshold has a range 0 to 400. scaling this to 0 to outputw
+	sky_threshold = (int)((float)outputw/400.)*sky_threshold;
+	// horizontal_extent has a range 1 to 360. scaling this to 0 to outputw
+	horizontal_extent = (int)((float)outputw/360.)*horizontal_extent;
+	cv::Mat dst, tmp, sky;
+	cv::Size dstsize = cv::Size(outputw,outputw);
+	// initialize dst with the same datatype as inputMat
+	// cv::resize(inputMat, dst, dstsize, 0, 0, cv::INTER_CUBIC);
+	// with the "sky" region stretched to fit
+	// For now, we take the sky to be the top 5 pixels of inputMat
+	inputMat.rowRange(1,5).copyTo(sky);
+	cv::resize(sky, dst, dstsize, 0, 0, cv::INTER_CUBIC);
+
+	cv::resize(inputMat, tmp, cv::Size(horizontal_extent, outputw-sky_threshold), 0, 0, cv::INTER_CUBIC);
+	//tmp.rowRange(1, outputw-sky_threshold).copyTo(dst.rowRange(sky_threshold+1, outputw));
+	int x =  (int)(outputw-horizontal_extent)/2;
+	int y =  sky_threshold;
+	if (x<2) { x=0;}
+	if (y<398) {// otherwise don't copy, since tmp may be too small
+	tmp.copyTo(dst(cv::Rect(x,y,tmp.cols, tmp.rows)));
+	}
+	
+	cv::Point2f centrepoint( (float)dst.cols / 2, (float)dst.rows / 2 );
+	double maxRadius = (double)dst.cols / 2;
+	    
+	int flags = cv::INTER_CUBIC + cv::WARP_FILL_OUTLIERS + cv::WARP_INVERSE_MAP;
+	cv::rotate(dst, dst, cv::ROTATE_90_COUNTERCLOCKWISE);
+	// this rotate is needed, since opencv's warpPolar() is written that way
+	
+	cv::warpPolar(dst, dst, dstsize, centrepoint, maxRadius, flags);
+		    // one more rotate is needed
+	cv::rotate(dst, dst, cv::ROTATE_90_COUNTERCLOCKWISE);
+	return dst;
+}
+	
+
+std::string escaped(const std::string& input)
+{
+	// https://stackoverflow.com/questions/48260879/how-to-replace-with-in-c-string
+	// needed for windows paths for opencv
+	std::string output;
+	output.reserve(input.size());
+	for (const char c: input) {
+		switch (c) {
+		    case '\a':  output += "\\a";        break;
+		    case '\b':  output += "\\b";        break;
+		    case '\f':  output += "\\f";        break;
+		    case '\n':  output += "\\n";        break;
+		    case '\r':  output += "\\r";        break;
+		    case '\t':  output += "\\t";        break;
+		    case '\v':  output += "\\v";        break;
+		    default:    output += c;            break;
+		}
+	}
+	return output;
+}
+
+//////////////////////////////////////////////
+// Strip-wise image writers. Rows are handed over in order, top to bottom,
+// so that the encoder can run while later rows are still being rendered,
+// and the complete output never has to be in memory.
+
+class StripWriter {
+public:
+	virtual ~StripWriter() {}
+	// rows are CV_8UC3, BGR, as from the render loop
+	virtual bool writeRows(const cv::Mat& rows) = 0;
+	// flushes and closes the file, returns false if anything failed
+	virtual bool finish() = 0;
+};
+
+#ifdef HAVE_LIBJPEG
+struct jpegErrorMgr {
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+	// the default error_exit calls exit(), we want to return an error instead
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((jpegErrorMgr*)cinfo->err)->setjmp_buffer, 1);
+}
+
+class JpegStripWriter : public StripWriter {
+public:
+	JpegStripWriter() : f(NULL), started(false), failed(false) {}
+	~JpegStripWriter() { abort(); }
+	bool open(const std::string& path, int width, int height, int quality) {
+		f = fopen(path.c_str(), "wb");
+		if (!f) return false;
+		cinfo.err = jpeg_std_error(&jerr.pub);
+		jerr.pub.error_exit = jpegErrorExit;
+		if (setjmp(jerr.setjmp_buffer)) {
+			failed = true;
+			return false;
+		}
+		jpeg_create_compress(&cinfo);
+		started = true;
+		jpeg_stdio_dest(&cinfo, f);
+		cinfo.image_width = width;
+		cinfo.image_height = height;
+		cinfo.input_components = 3;
+#ifdef JCS_EXTENSIONS
+		// libjpeg-turbo takes BGR rows directly
+		cinfo.in_color_space = JCS_EXT_BGR;
+#else
+		cinfo.in_color_space = JCS_RGB;
+		rgbrow.resize(width * 3);
+#endif
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		jpeg_start_compress(&cinfo, TRUE);
+		return true;
+	}
+	bool writeRows(const cv::Mat& rows) {
+		if (failed) return false;
+		if (setjmp(jerr.setjmp_buffer)) {
+			failed = true;
+			return false;
+		}
+		for (int y = 0; y < rows.rows; y++) {
+			JSAMPROW row = (JSAMPROW)rows.ptr<uchar>(y);
+#ifndef JCS_EXTENSIONS
+			for (int x = 0; x < rows.cols; x++) {
+				rgbrow[3*x] = row[3*x+2];
+				rgbrow[3*x+1] = row[3*x+1];
+				rgbrow[3*x+2] = row[3*x];
+			}
+			row = rgbrow.data();
+#endif
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+		return true;
+	}
+	bool finish() {
+		if (!failed && started) {
+			if (setjmp(jerr.setjmp_buffer)) {
+				failed = true;
+			}
+			else {
+				jpeg_finish_compress(&cinfo);
+			}
+		}
+		abort();
+		return !failed;
+	}
+private:
+	void abort() {
+		if (started) jpeg_destroy_compress(&cinfo);
+		started = false;
+		if (f) fclose(f);
+		f = NULL;
+	}
+	FILE* f;
+	bool started, failed;
+	struct jpeg_compress_struct cinfo;
+	jpegErrorMgr jerr;
+	std::vector<JSAMPLE> rgbrow;
+};
+
+bool readJpegYcc(const std::string& path, cv::Mat planes[3])
+{
+	// decodes a YCbCr 4:2:0 JPEG to its Y, Cb and Cr planes, without upsampling
+	// or colour conversion. Returns false for any other kind of JPEG.
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f) return false;
+	struct jpeg_decompress_struct cinfo;
+	jpegErrorMgr jerr;
+	// the row pointers of one iMCU row, at most 2*DCTSIZE rows for 4:2:0 luma.
+	// Plain arrays, since a decode error longjmps past anything declared below
+	JSAMPROW rows[3][2*DCTSIZE];
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpegErrorExit;
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	bool is420 = cinfo.num_components == 3 && cinfo.jpeg_color_space == JCS_YCbCr
+		&& cinfo.comp_info[0].h_samp_factor == 2 && cinfo.comp_info[0].v_samp_factor == 2;
+	for (int c = 1; c < cinfo.num_components && is420; c++)
+		is420 = cinfo.comp_info[c].h_samp_factor == 1 && cinfo.comp_info[c].v_samp_factor == 1;
+	if (!is420) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		return false;
+	}
+	cinfo.raw_data_out = TRUE;
+	jpeg_start_decompress(&cinfo);
+	// jpeg_read_raw_data writes whole blocks, one iMCU row (16 luma rows) per call
+	const int lines = cinfo.max_v_samp_factor * DCTSIZE;
+	for (int c = 0; c < 3; c++) {
+		jpeg_component_info* comp = &cinfo.comp_info[c];
+		planes[c].create(cinfo.total_iMCU_rows * comp->v_samp_factor * DCTSIZE, comp->width_in_blocks * DCTSIZE, CV_8UC1);
+	}
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int imcu = cinfo.output_scanline / lines;
+		JSAMPARRAY image[3];
+		for (int c = 0; c < 3; c++) {
+			int n = cinfo.comp_info[c].v_samp_factor * DCTSIZE;
+			for (int k = 0; k < n; k++)
+				rows[c][k] = planes[c].ptr<uchar>(imcu * n + k);
+			image[c] = rows[c];
+		}
+		jpeg_read_raw_data(&cinfo, image, lines);
+	}
+	for (int c = 0; c < 3; c++) {
+		jpeg_component_info* comp = &cinfo.comp_info[c];
+		planes[c] = planes[c](cv::Rect(0, 0, comp->downsampled_width, comp->downsampled_height));
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return true;
+}
+
+class JpegYccWriter {
+	// encodes Y, Cb and Cr planes as 4:2:0 from raw data, without colour conversion.
+	// Rows come in bands of an even number of luma rows, with the chroma rows under them.
+public:
+	JpegYccWriter() : f(NULL), started(false), failed(false), buffered(0), lastluma(2) {}
+	~JpegYccWriter() { abort(); }
+	bool open(const std::string& path, int width, int height, int quality) {
+		f = fopen(path.c_str(), "wb");
+		if (!f) return false;
+		cinfo.err = jpeg_std_error(&jerr.pub);
+		jerr.pub.error_exit = jpegErrorExit;
+		if (setjmp(jerr.setjmp_buffer)) {
+			failed = true;
+			return false;
+		}
+		jpeg_create_compress(&cinfo);
+		started = true;
+		jpeg_stdio_dest(&cinfo, f);
+		cinfo.image_width = width;
+		cinfo.image_height = height;
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_YCbCr;
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		cinfo.raw_data_in = TRUE;
+		cinfo.comp_info[0].h_samp_factor = cinfo.comp_info[0].v_samp_factor = 2;
+		for (int c = 1; c < 3; c++)
+			cinfo.comp_info[c].h_samp_factor = cinfo.comp_info[c].v_samp_factor = 1;
+		jpeg_start_compress(&cinfo, TRUE);
+		// one iMCU row, padded to whole blocks
+		for (int c = 0; c < 3; c++) {
+			int n = cinfo.comp_info[c].v_samp_factor * DCTSIZE;
+			imcu[c].create(n, cinfo.comp_info[c].width_in_blocks * DCTSIZE, CV_8UC1);
+			rows[c].resize(n);
+			for (int k = 0; k < n; k++)
+				rows[c][k] = imcu[c].ptr<uchar>(k);
+		}
+		return true;
+	}
+	bool writePlanes(const cv::Mat planes[3]) {
+		if (failed) return false;
+		if (setjmp(jerr.setjmp_buffer)) {
+			failed = true;
+			return false;
+		}
+		// two luma rows to each chroma row
+		for (int k = 0; k < planes[1].rows; k++) {
+			for (int r = 2*k; r < std::min(2*k + 2, planes[0].rows); r++) {
+				padRow(planes[0].ptr<uchar>(r), planes[0].cols, imcu[0].ptr<uchar>(2*buffered + r - 2*k), imcu[0].cols);
+			}
+			padRow(planes[1].ptr<uchar>(k), planes[1].cols, imcu[1].ptr<uchar>(buffered), imcu[1].cols);
+			padRow(planes[2].ptr<uchar>(k), planes[2].cols, imcu[2].ptr<uchar>(buffered), imcu[2].cols);
+			lastluma = std::min(2*k + 2, planes[0].rows) - 2*k;
+			if (++buffered == DCTSIZE) flush();
+		}
+		return true;
+	}
+	bool finish() {
+		if (!failed && started) {
+			if (setjmp(jerr.setjmp_buffer)) {
+				failed = true;
+			}
+			else {
+				if (buffered > 0) flush();
+				jpeg_finish_compress(&cinfo);
+			}
+		}
+		abort();
+		return !failed;
+	}
+private:
+	static void padRow(const uchar* src, int n, uchar* dst, int paddedn) {
+		memcpy(dst, src, n);
+		memset(dst + n, src[n - 1], paddedn - n);
+	}
+	void flush() {
+		// the rows past the end of the image repeat the last one
+		int lumarows = 2*(buffered - 1) + lastluma;
+		for (int r = lumarows; r < imcu[0].rows; r++)
+			imcu[0].row(lumarows - 1).copyTo(imcu[0].row(r));
+		for (int c = 1; c < 3; c++)
+			for (int r = buffered; r < imcu[c].rows; r++)
+				imcu[c].row(buffered - 1).copyTo(imcu[c].row(r));
+		JSAMPARRAY image[3] = { rows[0].data(), rows[1].data(), rows[2].data() };
+		jpeg_write_raw_data(&cinfo, image, imcu[0].rows);
+		buffered = 0;
+	}
+	void abort() {
+		if (started) jpeg_destroy_compress(&cinfo);
+		started = false;
+		if (f) fclose(f);
+		f = NULL;
+	}
+	FILE* f;
+	bool started, failed;
+	// chroma rows in imcu so far, and luma rows under the last one, 1 at the bottom of an odd height
+	int buffered, lastluma;
+	struct jpeg_compress_struct cinfo;
+	jpegErrorMgr jerr;
+	cv::Mat imcu[3];
+	std::vector<JSAMPROW> rows[3];
+};
+#endif
+
+#ifdef HAVE_LIBPNG
+class PngStripWriter : public StripWriter {
+public:
+	PngStripWriter() : f(NULL), png(NULL), info(NULL), failed(false) {}
+	~PngStripWriter() { abort(); }
+	bool open(const std::string& path, int width, int height, int compression) {
+		f = fopen(path.c_str(), "wb");
+		if (!f) return false;
+		png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (png) info = png_create_info_struct(png);
+		if (!png || !info) return false;
+		if (setjmp(png_jmpbuf(png))) {
+			failed = true;
+			return false;
+		}
+		png_init_io(png, f);
+		png_set_compression_level(png, compression);
+		png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_write_info(png, info);
+		png_set_bgr(png);
+		return true;
+	}
+	bool writeRows(const cv::Mat& rows) {
+		if (failed) return false;
+		if (setjmp(png_jmpbuf(png))) {
+			failed = true;
+			return false;
+		}
+		for (int y = 0; y < rows.rows; y++) {
+			png_write_row(png, (png_const_bytep)rows.ptr<uchar>(y));
+		}
+		return true;
+	}
+	bool finish() {
+		if (!failed) {
+			if (setjmp(png_jmpbuf(png))) {
+				failed = true;
+			}
+			else {
+				png_write_end(png, NULL);
+			}
+		}
+		abort();
+		return !failed;
+	}
+private:
+	void abort() {
+		if (png) png_destroy_write_struct(&png, info ? &info : NULL);
+		png = NULL;
+		info = NULL;
+		if (f) fclose(f);
+		f = NULL;
+	}
+	FILE* f;
+	png_structp png;
+	png_infop info;
+	bool failed;
+};
+#endif
+
+class ImwriteStripWriter : public StripWriter {
+	// fallback for other formats, or when built without libjpeg / libpng:
+	// collects the rows and writes them with cv::imwrite at the end
+public:
+	ImwriteStripWriter(const std::string& path, int width, int height) : path(path), nextrow(0) {
+		img.create(height, width, CV_8UC3);
+	}
+	bool writeRows(const cv::Mat& rows) {
+		rows.copyTo(img.rowRange(nextrow, nextrow + rows.rows));
+		nextrow += rows.rows;
+		return true;
+	}
+	bool finish() {
+		bool ok = false;
+		try {
+			ok = cv::imwrite(path, img);
+		} catch (...) {
+			std::cout << "Exception occurred in imwrite!" << std::endl;
+		}
+		img.release();
+		return ok;
+	}
+private:
+	std::string path;
+	cv::Mat img;
+	int nextrow;
+};
+
+class QueuedStripWriter : public StripWriter {
+	// runs another StripWriter on its own thread, so that encoding overlaps rendering.
+	// At most maxqueued strips wait for the encoder, to keep memory bounded.
+public:
+	QueuedStripWriter(std::unique_ptr<StripWriter> w, size_t maxqueued) : writer(std::move(w)), maxqueued(maxqueued), done(false), ok(true) {
+		encoder = std::thread(&QueuedStripWriter::run, this);
+	}
+	~QueuedStripWriter() { finish(); }
+	bool writeRows(const cv::Mat& rows) {
+		std::unique_lock<std::mutex> lock(m);
+		cv_space.wait(lock, [this] { return queue.size() < maxqueued || !ok; });
+		if (!ok) return false;
+		queue.push_back(rows.clone());
+		cv_work.notify_one();
+		return true;
+	}
+	bool finish() {
+		if (encoder.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(m);
+				done = true;
+			}
+			cv_work.notify_one();
+			encoder.join();
+			ok = writer->finish() && ok;
+		}
+		return ok;
+	}
+private:
+	void run() {
+		std::unique_lock<std::mutex> lock(m);
+		while (true) {
+			cv_work.wait(lock, [this] { return !queue.empty() || done; });
+			if (queue.empty()) break;
+			cv::Mat rows = queue.front();
+			lock.unlock();
+			bool written = writer->writeRows(rows);
+			lock.lock();
+			queue.pop_front();
+			if (!written) {
+				ok = false;
+				queue.clear();
+			}
+			cv_space.notify_one();
+		}
+	}
+	std::unique_ptr<StripWriter> writer;
+	size_t maxqueued;
+	bool done, ok;
+	std::deque<cv::Mat> queue;
+	std::mutex m;
+	std::condition_variable cv_work, cv_space;
+	std::thread encoder;
+};
+
+std::string lowercaseExtension(const std::string& path)
+{
+	std::string::size_type i = path.rfind('.');
+	if (i == std::string::npos) return "";
+	std::string ext = path.substr(i + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext;
+}
+
+bool canStreamTo(const std::string& path)
+{
+	// whether openStripWriter has a streaming encoder for this file type
+	std::string ext = lowercaseExtension(path);
+#ifdef HAVE_LIBJPEG
+	if (ext == "jpg" || ext == "jpeg") return true;
+#endif
+#ifdef HAVE_LIBPNG
+	if (ext == "png") return true;
+#endif
+	return false;
+}
+
+enum SaveStage { SAVE_PREPARING, SAVE_RENDERING, SAVE_FINISHING, SAVE_DONE };
+
+struct SaveProgress {
+	// shared between a save running on its own thread and the UI
+	std::atomic<int> stage;
+	// output rows rendered, and rows the encoder has taken
+	std::atomic<int> rendered;
+	std::atomic<int> encoded;
+	// set by the UI, the save stops at its next band
+	std::atomic<bool> cancel;
+	// set once the output file has been opened for writing
+	std::atomic<bool> opened;
+	SaveProgress() : stage(SAVE_PREPARING), rendered(0), encoded(0), cancel(false), opened(false) {}
+};
+
+class ProgressStripWriter : public StripWriter {
+	// counts the rows reaching the encoder it wraps, and stops it when the save is cancelled
+public:
+	ProgressStripWriter(std::unique_ptr<StripWriter> w, SaveProgress& progress) : writer(std::move(w)), progress(progress) {}
+	bool writeRows(const cv::Mat& rows) {
+		if (progress.cancel) return false;
+		if (!writer->writeRows(rows)) return false;
+		progress.encoded += rows.rows;
+		return true;
+	}
+	bool finish() {
+		return writer->finish();
+	}
+private:
+	std::unique_ptr<StripWriter> writer;
+	SaveProgress& progress;
+};
+
+std::unique_ptr<StripWriter> openStripWriter(const std::string& path, int width, int height, SaveProgress* progress = NULL)
+{
+	// picks a streaming encoder by file extension, returns nullptr if the file can't be opened.
+	// With progress, the rows the encoder takes are counted there.
+	std::string ext = lowercaseExtension(path);
+	std::unique_ptr<StripWriter> writer;
+#ifdef HAVE_LIBJPEG
+	if (ext == "jpg" || ext == "jpeg") {
+		// same default quality as cv::imwrite
+		JpegStripWriter* jw = new JpegStripWriter();
+		writer.reset(jw);
+		if (!jw->open(path, width, height, 95)) return nullptr;
+	}
+#endif
+#ifdef HAVE_LIBPNG
+	if (ext == "png") {
+		PngStripWriter* pw = new PngStripWriter();
+		writer.reset(pw);
+		// same default compression level as cv::imwrite
+		if (!pw->open(path, width, height, 1)) return nullptr;
+	}
+#endif
+	bool streaming = (bool)writer;
+	if (!streaming) {
+		writer.reset(new ImwriteStripWriter(path, width, height));
+	}
+	if (progress) {
+		writer.reset(new ProgressStripWriter(std::move(writer), *progress));
+		progress->opened = true;
+	}
+	if (!streaming) {
+		return writer;
+	}
+	return std::unique_ptr<StripWriter>(new QueuedStripWriter(std::move(writer), 2));
+}
+
+bool imageFileSize(const std::string& path, int& width, int& height)
+{
+	// reads just the header of a JPEG (SOFn marker) or PNG (IHDR chunk),
+	// to find the image size without decoding it
+	std::ifstream f(path.c_str(), std::ios::binary);
+	if (!f) return false;
+	unsigned char b[24];
+	if (!f.read((char*)b, 2)) return false;
+	if (b[0] == 0x89 && b[1] == 'P') {
+		if (!f.read((char*)b + 2, 22)) return false;
+		width = (b[16] << 24) | (b[17] << 16) | (b[18] << 8) | b[19];
+		height = (b[20] << 24) | (b[21] << 16) | (b[22] << 8) | b[23];
+		return true;
+	}
+	if (b[0] != 0xFF || b[1] != 0xD8) return false;
+	while (f.read((char*)b, 2)) {
+		if (b[0] != 0xFF) return false;
+		unsigned char marker = b[1];
+		while (marker == 0xFF) {
+			// fill bytes
+			if (!f.read((char*)&marker, 1)) return false;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) continue;	// no length field
+		if (marker == 0xDA || marker == 0xD9) return false;	// start of scan or end, with no SOF
+		if (!f.read((char*)b, 2)) return false;
+		int length = (b[0] << 8) | b[1];
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			if (!f.read((char*)b, 5)) return false;
+			height = (b[1] << 8) | b[2];
+			width = (b[3] << 8) | b[4];
+			return true;
+		}
+		f.seekg(length - 2, std::ios::cur);
+	}
+	return false;
+}
+
+//////////////////////////////////////////////
+// Tiled sources, for panoramas too large to decode into memory in one go.
+// Tiles are decoded on demand and kept in an LRU cache with a memory cap.
+
+// default memory cap for decoded source tiles
+#define TILE_CACHE_BYTES ((size_t)512*1024*1024)
+
+class TiledSource {
+public:
+	virtual ~TiledSource() {}
+	int width, height, tilew, tileh;
+	int tilesAcross() const { return (width + tilew - 1) / tilew; }
+	int tilesDown() const { return (height + tileh - 1) / tileh; }
+	// decodes tile (tx, ty) as CV_8UC3 BGR, smaller than tilew x tileh at the right and bottom edges
+	virtual bool readTile(int tx, int ty, cv::Mat& tile) = 0;
+};
+
+#ifdef HAVE_LIBTIFF
+// rows in each tile of a stripped TIFF, whatever its ROWSPERSTRIP,
+// which is often the whole image
+#define STRIP_TILE_ROWS 256
+
+class TiffTiledSource : public TiledSource {
+	// tiled TIFFs are read tile by tile, through libtiff's RGBA interface so that
+	// any photometric / bit depth works. Stripped TIFFs are cut into tiles of
+	// STRIP_TILE_ROWS full width rows, read scanline by scanline when they are
+	// 8 bit RGB or grey, and through the RGBA interface otherwise
+public:
+	TiffTiledSource() : tif(NULL), tiled(false), scanlines(false), grey(false), samples(0) {}
+	~TiffTiledSource() { if (tif) TIFFClose(tif); }
+	bool open(const std::string& path) {
+		tif = TIFFOpen(path.c_str(), "r");
+		if (!tif) return false;
+		uint32_t w = 0, h = 0, tw = 0, th = 0;
+		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+		tiled = TIFFIsTiled(tif) != 0;
+		if (tiled) {
+			TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+			TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+		}
+		else {
+			tw = w;
+			th = std::min((uint32_t)STRIP_TILE_ROWS, h);
+			uint16_t bits = 0, spp = 0, planar = 0, photometric = 0;
+			TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+			TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+			TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+			TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+			samples = spp;
+			grey = photometric == PHOTOMETRIC_MINISBLACK;
+			scanlines = bits == 8 && planar == PLANARCONFIG_CONTIG
+				&& ((photometric == PHOTOMETRIC_RGB && spp >= 3) || (grey && spp >= 1));
+		}
+		width = w; height = h; tilew = tw; tileh = th;
+		if (width <= 0 || height <= 0 || tilew <= 0 || tileh <= 0) return false;
+		if (scanlines) {
+			scanline.resize(TIFFScanlineSize(tif));
+		}
+		else {
+			raster.resize((size_t)tilew * tileh);
+		}
+		return true;
+	}
+	bool readTile(int tx, int ty, cv::Mat& tile) {
+		int readw = std::min(tilew, width - tx*tilew);
+		int readh = std::min(tileh, height - ty*tileh);
+		if (scanlines) {
+			return readScanlines(ty*tileh, readh, tile);
+		}
+		int ok;
+		// the RGBA raster has its origin at the bottom left:
+		// for tiles, row r of the image is raster row tileh-1-r, for strips it is readh-1-r
+		int flipfrom;
+		if (tiled) {
+			ok = TIFFReadRGBATile(tif, tx*tilew, ty*tileh, raster.data());
+			flipfrom = tileh - 1;
+		}
+		else {
+			// what TIFFReadRGBAStrip does, but for readh rows rather than a whole strip
+			char emsg[1024];
+			TIFFRGBAImage img;
+			ok = TIFFRGBAImageOK(tif, emsg) && TIFFRGBAImageBegin(&img, tif, 0, emsg);
+			if (ok) {
+				img.row_offset = ty*tileh;
+				img.col_offset = 0;
+				ok = TIFFRGBAImageGet(&img, raster.data(), tilew, readh);
+				TIFFRGBAImageEnd(&img);
+			}
+			flipfrom = readh - 1;
+		}
+		if (!ok) return false;
+		tile.create(readh, readw, CV_8UC3);
+		for (int r = 0; r < readh; r++) {
+			const uint32_t* s = &raster[(size_t)(flipfrom - r) * tilew];
+			uchar* d = tile.ptr<uchar>(r);
+			for (int c = 0; c < readw; c++) {
+				d[3*c] = TIFFGetB(s[c]);
+				d[3*c+1] = TIFFGetG(s[c]);
+				d[3*c+2] = TIFFGetR(s[c]);
+			}
+		}
+		return true;
+	}
+private:
+	bool readScanlines(int firstrow, int rows, cv::Mat& tile) {
+		// libtiff decodes a strip incrementally for TIFFReadScanline, so only one
+		// row is held at a time however long the strips are. The tiles are mostly
+		// asked for top to bottom, which is the order it reads them fastest
+		tile.create(rows, width, CV_8UC3);
+		for (int r = 0; r < rows; r++) {
+			if (TIFFReadScanline(tif, scanline.data(), firstrow + r, 0) < 0) return false;
+			const uchar* s = scanline.data();
+			uchar* d = tile.ptr<uchar>(r);
+			for (int c = 0; c < width; c++) {
+				if (grey) {
+					d[3*c] = d[3*c+1] = d[3*c+2] = s[samples*c];
+				}
+				else {
+					d[3*c] = s[samples*c+2];
+					d[3*c+1] = s[samples*c+1];
+					d[3*c+2] = s[samples*c];
+				}
+			}
+		}
+		return true;
+	}
+	TIFF* tif;
+	bool tiled;
+	// for stripped TIFFs read with TIFFReadScanline
+	bool scanlines, grey;
+	int samples;
+	std::vector<uint32_t> raster;
+	std::vector<uchar> scanline;
+};
+#endif
+
+class TileCache {
+	// LRU cache of decoded tiles, evicting least recently used tiles above maxbytes.
+	// Reads from the source are serialized, since decoders like libtiff are not thread safe.
+public:
+	TileCache(TiledSource& source, size_t maxbytes) : source(source), maxbytes(maxbytes), bytes(0) {}
+	~TileCache() { waitPrefetch(); }
+	cv::Mat get(int tx, int ty) {
+		long long key = (long long)ty * source.tilesAcross() + tx;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			std::map<long long, std::list<Entry>::iterator>::iterator it = index.find(key);
+			if (it != index.end()) {
+				lru.splice(lru.begin(), lru, it->second);
+				return it->second->tile;
+			}
+		}
+		cv::Mat tile;
+		{
+			std::lock_guard<std::mutex> lock(readmutex);
+			if (!source.readTile(tx, ty, tile)) {
+				std::cout << "Could not read tile " << tx << ", " << ty << std::endl;
+				tile = cv::Mat(std::min(source.tileh, source.height - ty*source.tileh),
+					std::min(source.tilew, source.width - tx*source.tilew), CV_8UC3, cv::Scalar(0, 0, 0));
+			}
+		}
+		std::lock_guard<std::mutex> lock(m);
+		if (index.find(key) == index.end()) {
+			Entry e;
+			e.key = key;
+			e.tile = tile;
+			lru.push_front(e);
+			index[key] = lru.begin();
+			bytes += tile.total() * tile.elemSize();
+			while (bytes > maxbytes && lru.size() > 1) {
+				bytes -= lru.back().tile.total() * lru.back().tile.elemSize();
+				index.erase(lru.back().key);
+				lru.pop_back();
+			}
+		}
+		return tile;
+	}
+	void prefetchRow(int ty) {
+		// decodes a whole row of tiles in the background, as one batch
+		waitPrefetch();
+		if (ty >= source.tilesDown()) return;
+		prefetcher = std::thread([this, ty] {
+			for (int tx = 0; tx < source.tilesAcross(); tx++) get(tx, ty);
+		});
+	}
+	void waitPrefetch() {
+		if (prefetcher.joinable()) prefetcher.join();
+	}
+	// box-filtered copy of the whole source at outw x outh, built one row of tiles at a time
+	cv::Mat reduce(int outw, int outh);
+private:
+	struct Entry {
+		long long key;
+		cv::Mat tile;
+	};
+	TiledSource& source;
+	size_t maxbytes, bytes;
+	std::list<Entry> lru;
+	std::map<long long, std::list<Entry>::iterator> index;
+	std::mutex m, readmutex;
+	std::thread prefetcher;
+};
+
+cv::Mat TileCache::reduce(int outw, int outh)
+{
+	// each source pixel is added to the output pixel it falls in, and each output row
+	// is normalized once all the source rows for it have been added, so only
+	// one row of tiles and a few accumulator rows are in memory at any time
+	cv::Mat out(outh, outw, CV_8UC3);
+	std::vector<int> outcol(source.width);
+	std::vector<float> colcount(outw, 0.f);
+	for (int x = 0; x < source.width; x++) {
+		outcol[x] = (int)((long long)x * outw / source.width);
+		colcount[outcol[x]] += 1.f;
+	}
+	// accumulators for the output rows touched by the current row of tiles
+	std::map<int, std::vector<float> > acc;
+	std::map<int, int> rowcount;
+	int nextout = 0;
+	prefetchRow(0);
+	for (int ty = 0; ty < source.tilesDown(); ty++) {
+		waitPrefetch();
+		prefetchRow(ty + 1);
+		for (int tx = 0; tx < source.tilesAcross(); tx++) {
+			cv::Mat tile = get(tx, ty);
+			for (int r = 0; r < tile.rows; r++) {
+				int y = ty*source.tileh + r;
+				int oy = (int)((long long)y * outh / source.height);
+				std::vector<float>& a = acc[oy];
+				if (a.empty()) a.assign(outw * 3, 0.f);
+				if (tx == 0) rowcount[oy]++;
+				const uchar* s = tile.ptr<uchar>(r);
+				const int* oc = &outcol[tx*source.tilew];
+				for (int c = 0; c < tile.cols; c++) {
+					float* d = &a[oc[c] * 3];
+					d[0] += s[3*c];
+					d[1] += s[3*c+1];
+					d[2] += s[3*c+2];
+				}
+			}
+		}
+		// output rows below the last source row read so far are complete
+		int lastrow = std::min((ty + 1) * source.tileh, source.height) - 1;
+		int completeto = (ty == source.tilesDown() - 1) ? outh : (int)((long long)(lastrow + 1) * outh / source.height);
+		for (; nextout < completeto; nextout++) {
+			uchar* d = out.ptr<uchar>(nextout);
+			std::map<int, std::vector<float> >::iterator it = acc.find(nextout);
+			if (it == acc.end()) {
+				// can only happen when upscaling, repeat the previous row
+				if (nextout > 0) out.row(nextout - 1).copyTo(out.row(nextout));
+				else out.row(nextout) = cv::Scalar(0, 0, 0);
+				continue;
+			}
+			const float* a = it->second.data();
+			float rc = (float)rowcount[nextout];
+			for (int c = 0; c < outw; c++) {
+				float n = rc * colcount[c];
+				if (n <= 0.f) n = 1.f;
+				d[3*c] = cv::saturate_cast<uchar>(a[3*c] / n);
+				d[3*c+1] = cv::saturate_cast<uchar>(a[3*c+1] / n);
+				d[3*c+2] = cv::saturate_cast<uchar>(a[3*c+2] / n);
+			}
+			acc.erase(it);
+			rowcount.erase(nextout);
+		}
+	}
+	waitPrefetch();
+	return out;
+}
+
+int jpegScale(int width, int neededwidth)
+{
+	// the largest DCT scaling, 8, 4 or 2, that still gives at least neededwidth pixels, or 1
+	const int scales[3] = { 8, 4, 2 };
+	for (int k = 0; k < 3; k++) {
+		if ((width + scales[k] - 1) / scales[k] >= neededwidth) return scales[k];
+	}
+	return 1;
+}
+
+cv::Size decodedPanSize(const std::string& path, int neededwidth)
+{
+	// the size readPan() will return, from the file header only, or 0x0 if unknown
+	std::string ext = lowercaseExtension(path);
+#ifdef HAVE_LIBTIFF
+	if (ext == "tif" || ext == "tiff") {
+		TiffTiledSource tiff;
+		if (!tiff.open(path)) return cv::Size();
+		if (tiff.width > neededwidth) {
+			return cv::Size(neededwidth, std::max(1, (int)((long long)tiff.height * neededwidth / tiff.width)));
+		}
+		return cv::Size(tiff.width, tiff.height);
+	}
+#endif
+	int width = 0, height = 0;
+	if (!imageFileSize(path, width, height)) return cv::Size();
+	if (ext == "jpg" || ext == "jpeg") {
+		int s = jpegScale(width, neededwidth);
+		return cv::Size((width + s - 1) / s, (height + s - 1) / s);
+	}
+	return cv::Size(width, height);
+}
+
+cv::Mat readPan(const std::string& path, int neededwidth)
+{
+	// the pan gets resized to at most the intermediate width, so for large JPEGs
+	// we let libjpeg decode at 1/2, 1/4 or 1/8 scale (DCT domain scaling)
+	// as long as that still gives at least neededwidth pixels
+	int flags = cv::IMREAD_COLOR;
+	int width = 0, height = 0;
+	std::string ext = lowercaseExtension(path);
+#ifdef HAVE_LIBTIFF
+	if (ext == "tif" || ext == "tiff") {
+		// TIFFs are read through a tile cache, so that gigapixel sources which
+		// do not fit in memory are reduced to neededwidth without decoding them whole
+		TiffTiledSource tiff;
+		if (tiff.open(path) && tiff.width > neededwidth) {
+			int reducedh = std::max(1, (int)((long long)tiff.height * neededwidth / tiff.width));
+			std::cout << "Reading " << tiff.width << "x" << tiff.height << " in " << tiff.tilew << "x" << tiff.tileh
+				<< " tiles, reduced to " << neededwidth << "x" << reducedh << std::endl;
+			TileCache cache(tiff, TILE_CACHE_BYTES);
+			return cache.reduce(neededwidth, reducedh);
+		}
+	}
+#endif
+	if ((ext == "jpg" || ext == "jpeg") && imageFileSize(path, width, height)) {
+		int s = jpegScale(width, neededwidth);
+		if (s > 1) {
+			flags = (s == 8) ? cv::IMREAD_REDUCED_COLOR_8 : (s == 4) ? cv::IMREAD_REDUCED_COLOR_4 : cv::IMREAD_REDUCED_COLOR_2;
+			std::cout << "Decoding " << width << "x" << height << " at 1/" << s << " scale" << std::endl;
+		}
+	}
+	return cv::imread(path, flags);
+}
+
+bool saveFisheyeYcc(const std::string& path, const std::string& savepath, int neededwidth, int sky_threshold, int horizontal_extent,
+	int move_down, int rotate_down, int outputw, int bandh, bool mipmap, bool& written, SaveProgress* progress = NULL)
+{
+	// renders and saves through the YCbCr 4:2:0 path, when both files are JPEGs, the input
+	// is 4:2:0 and would be decoded at full scale anyway. Returns false if it doesn't apply,
+	// and the BGR path should be used.
+	written = false;
+#ifdef HAVE_LIBJPEG
+	std::string ext = lowercaseExtension(path), saveext = lowercaseExtension(savepath);
+	if ((ext != "jpg" && ext != "jpeg") || (saveext != "jpg" && saveext != "jpeg")) return false;
+	int width = 0, height = 0;
+	if (!imageFileSize(path, width, height) || jpegScale(width, neededwidth) > 1) return false;
+	cv::Mat planes[3];
+	if (!readJpegYcc(path, planes)) return false;
+	std::cout << "Saving in YCbCr 4:2:0" << std::endl;
+	JpegYccWriter writer;
+	if (writer.open(savepath, outputw, outputw, 95)) {
+		if (progress) progress->opened = true;
+		written = equirectToFisheyeBandedYcc(planes, sky_threshold, horizontal_extent, move_down, rotate_down, outputw, bandh, mipmap,
+			[&](const cv::Mat bands[3], int firstrow) {
+				if (progress && progress->cancel) return false;
+				if (!writer.writePlanes(bands)) return false;
+				if (progress) {
+					progress->stage = SAVE_RENDERING;
+					progress->rendered = progress->encoded = firstrow + bands[0].rows;
+				}
+				return true;
+			});
+	}
+	if (progress) progress->stage = SAVE_FINISHING;
+	written = writer.finish() && written;
+	return true;
+#else
+	return false;
+#endif
+}
+
+cv::Mat previewProxy(const cv::Mat& img)
+{
+	// placePan never resizes the pan wider than the intermediate, so anything wider
+	// than the preview's intermediate is wasted on previews. Built once at load,
+	// the full resolution image is kept for Save.
+	int proxyw = intermediateSize(PREVIEW_WIDTH).width;
+	if (img.cols <= proxyw) return img;
+	cv::Mat proxy;
+	cv::resize(img, proxy, cv::Size(proxyw, std::max(1, (int)((long long)img.rows * proxyw / img.cols))), 0, 0, cv::INTER_AREA);
+	std::cout << "Previewing from a " << proxy.cols << "x" << proxy.rows << " proxy" << std::endl;
+	return proxy;
+}
+
+//////////////////////////////////////////////
+// Preview renderer. The sliders only post their values, and a worker
+// thread renders them, so that the window stays responsive. There is a
+// single slot for the next parameters: a newer post replaces one which
+// hasn't started, and makes the render in progress give up at its next
+// stage boundary. The UI shows whichever frame completed last.
+// While a slider is dragged, previews are drafts: a governor picks their
+// size from the time the last drafts took, and they are not inpainted.
+// Drafts are not cancelled, so that a drag keeps showing frames, and the
+// full quality preview follows on release.
+
+// When idle, the worker also renders the values one and five steps either
+// side of the slider touched last, into a small cache of finished previews
+// keyed by all four values, which also serves going back to earlier values.
+
+// frame time the governor aims for, while dragging
+#define PREVIEW_TARGET_MS 40
+// sizes the governor can choose from, in draftwidths
+#define DRAFT_LEVELS 5
+// finished previews kept, about 0.5 MB each
+#define PREVIEW_CACHE_ENTRIES 32
+// renders whose stage times are kept for the timing display
+#define TIMING_HISTORY 60
+
+enum PreviewSlider { SLIDER_NONE = -1, SLIDER_SKY, SLIDER_EXTENT, SLIDER_MOVE_DOWN, SLIDER_ROTATE_DOWN };
+
+struct PreviewParams {
+	int sky_threshold;
+	int horizontal_extent;
+	int move_down;
+	int rotate_down;
+	bool draft;
+	// the slider moved last, whose neighbouring values are rendered speculatively
+	int slider;
+};
+
+class PreviewRenderer
+{
+public:
+	PreviewRenderer(cv::Mat source, MapStorage mapstorage) : source(source), posted(false), stopping(false), fresh(false), rendering(false), draftlevel(0), shown(0), generation(0) {
+		ws.maps.storage = mapstorage;
+		ws.memoize = true;
+		worker = std::thread(&PreviewRenderer::run, this);
+	}
+	~PreviewRenderer() {
+		{
+			std::lock_guard<std::mutex> lock(m);
+			stopping = true;
+			generation++;
+		}
+		cv_post.notify_one();
+		worker.join();
+	}
+	void post(const PreviewParams& params) {
+		std::lock_guard<std::mutex> lock(m);
+		generation++;
+		speculative.clear();
+		cv::Mat cached;
+		if (lookup(params, cached)) {
+			// rendered before, or speculatively
+			completed = cached;
+			fresh = true;
+			shown = generation;
+			posted = false;
+			queueNeighbours(params);
+		}
+		else {
+			next = params;
+			posted = true;
+		}
+		cv_post.notify_one();
+	}
+	bool latest(cv::Mat& frame) {
+		// the frame completed last, if it hasn't been taken yet
+		std::lock_guard<std::mutex> lock(m);
+		if (!fresh) return false;
+		frame = completed;
+		fresh = false;
+		return true;
+	}
+	bool busy() {
+		// whether a post is waiting or rendering, not counting the speculative renders
+		std::lock_guard<std::mutex> lock(m);
+		return posted || rendering;
+	}
+	void setSource(cv::Mat s) {
+		// for a renderer created without a source, while the image is still being read.
+		// Posts wait for it, and the last one is rendered once it is set
+		std::lock_guard<std::mutex> lock(m);
+		source = s;
+		cv_post.notify_one();
+	}
+	void stageTimes(std::vector<double> history[RENDER_STAGES + 1]) {
+		// the milliseconds of each stage, and the total last, over the recent renders shown
+		std::lock_guard<std::mutex> lock(m);
+		for (int s = 0; s <= RENDER_STAGES; s++)
+			history[s] = timings[s];
+	}
+private:
+	void run() {
+		std::unique_lock<std::mutex> lock(m);
+		while (true) {
+			cv_post.wait(lock, [this] { return stopping || (!source.empty() && (posted || !speculative.empty())); });
+			if (stopping) break;
+			const bool speculating = !posted;
+			PreviewParams p;
+			if (posted) {
+				p = next;
+				posted = false;
+			}
+			else {
+				p = speculative.front();
+				speculative.pop_front();
+			}
+			const unsigned long mine = generation;
+			rendering = !speculating;
+			lock.unlock();
+			const int width = p.draft ? draftwidths[draftlevel] : PREVIEW_WIDTH;
+			int64 start = cv::getTickCount();
+			cv::Mat frame;
+			if (p.draft) {
+				frame = equirectToFisheye(source, p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down, width, ws, false);
+				govern(msSince(start));
+			}
+			else {
+				frame = equirectToFisheye(source, p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down, width, ws, true,
+					[this, mine] { return generation != mine; });
+			}
+			// the workspace is overwritten by the next render, so the UI gets a copy, at the size it shows
+			if (!frame.empty()) {
+				if (width != PREVIEW_WIDTH) cv::resize(frame, frame, cv::Size(PREVIEW_WIDTH, PREVIEW_WIDTH), 0, 0, cv::INTER_LINEAR);
+				else frame = frame.clone();
+			}
+			const double total = msSince(start);
+			lock.lock();
+			rendering = false;
+			if (frame.empty()) continue;
+			if (!p.draft) remember(p, frame);
+			// Not over a frame of a later post, as from the cache. An older draft may still
+			// show while a newer one renders, so that a drag keeps showing frames
+			if (!speculating && mine >= shown) {
+				completed = frame;
+				fresh = true;
+				shown = mine;
+				recordTimes(total);
+				if (!p.draft && generation == mine) queueNeighbours(p);
+			}
+		}
+	}
+	void govern(double ms) {
+		// one step smaller when a draft overran the target, one step larger when it took
+		// well under, so that the size settles where drafts keep up with the mouse
+		if (ms > PREVIEW_TARGET_MS && draftlevel + 1 < DRAFT_LEVELS) draftlevel++;
+		else if (ms < PREVIEW_TARGET_MS / 2 && draftlevel > 0) draftlevel--;
+	}
+	void recordTimes(double total) {
+		// with m held
+		for (int s = 0; s <= RENDER_STAGES; s++) {
+			timings[s].push_back(s < RENDER_STAGES ? ws.stagems[s] : total);
+			if (timings[s].size() > TIMING_HISTORY) timings[s].erase(timings[s].begin());
+		}
+	}
+	static std::vector<int> resultKey(const PreviewParams& p) {
+		return { p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down };
+	}
+	bool lookup(const PreviewParams& p, cv::Mat& frame) {
+		// with m held
+		std::vector<int> key = resultKey(p);
+		for (std::list<std::pair<std::vector<int>, cv::Mat> >::iterator it = results.begin(); it != results.end(); ++it) {
+			if (it->first == key) {
+				results.splice(results.begin(), results, it);
+				frame = results.front().second;
+				return true;
+			}
+		}
+		return false;
+	}
+	void remember(const PreviewParams& p, const cv::Mat& frame) {
+		// with m held
+		cv::Mat existing;
+		if (lookup(p, existing)) return;
+		if (results.size() >= PREVIEW_CACHE_ENTRIES) results.pop_back();
+		results.push_front(std::make_pair(resultKey(p), frame));
+	}
+	void queueNeighbours(const PreviewParams& p) {
+		// with m held. The same limits as the trackbars in main()
+		static const int lo[4] = { 0, 5, 0, -180 };
+		static const int hi[4] = { 395, 360, 395, 180 };
+		static const int steps[4] = { 1, -1, 5, -5 };
+		if (p.slider < 0 || p.slider > SLIDER_ROTATE_DOWN) return;
+		for (int k = 0; k < 4; k++) {
+			PreviewParams q = p;
+			q.draft = false;
+			int* v = (p.slider == SLIDER_SKY) ? &q.sky_threshold : (p.slider == SLIDER_EXTENT) ? &q.horizontal_extent
+				: (p.slider == SLIDER_MOVE_DOWN) ? &q.move_down : &q.rotate_down;
+			int moved = std::min(std::max(*v + steps[k], lo[p.slider]), hi[p.slider]);
+			if (moved == *v) continue;
+			*v = moved;
+			cv::Mat existing;
+			if (!lookup(q, existing)) speculative.push_back(q);
+		}
+	}
+	const int draftwidths[DRAFT_LEVELS] = { 400, 320, 240, 160, 100 };
+	cv::Mat source;
+	// used by the worker only
+	RenderWorkspace ws;
+	PreviewParams next;
+	bool posted, stopping, fresh;
+	// whether the worker is rendering a post
+	bool rendering;
+	// index into draftwidths, for the next draft
+	int draftlevel;
+	cv::Mat completed;
+	// the generation completed is from
+	unsigned long shown;
+	// finished full quality previews, most recently used first
+	std::list<std::pair<std::vector<int>, cv::Mat> > results;
+	// neighbouring values still to render when idle
+	std::deque<PreviewParams> speculative;
+	// stage times of the renders shown, oldest first, with the totals last
+	std::vector<double> timings[RENDER_STAGES + 1];
+	// bumped by every post, so a render can tell it has been superseded
+	std::atomic<unsigned long> generation;
+	std::mutex m;
+	std::condition_variable cv_post;
+	std::thread worker;
+};
+
+//////////////////////////////////////////////
+// Loupe. While the mouse is over the preview, the full resolution output
+// around the cursor is rendered on its own thread, one pixel per pixel,
+// to check seams and aliasing without a full render.
+
+// width and height of the loupe, in output pixels
+#define LOUPE_SIZE 160
+
+class LoupeRenderer
+{
+public:
+	LoupeRenderer(cv::Mat source, int outputw) : source(source), outputw(outputw), nextmipmap(false), posted(false), stopping(false), fresh(false), rendering(false) {
+		// the full resolution placement is kept while only the cursor moves
+		ws.memoize = true;
+		worker = std::thread(&LoupeRenderer::run, this);
+	}
+	~LoupeRenderer() {
+		{
+			std::lock_guard<std::mutex> lock(m);
+			stopping = true;
+		}
+		cv_post.notify_one();
+		worker.join();
+	}
+	void post(const PreviewParams& params, bool mipmap, cv::Point centre) {
+		// centre is in output pixels. Does nothing if it was posted last
+		std::vector<int> key = { params.sky_threshold, params.horizontal_extent, params.move_down, params.rotate_down, (int)mipmap, centre.x, centre.y };
+		std::lock_guard<std::mutex> lock(m);
+		if (key == lastkey) return;
+		lastkey = key;
+		next = params;
+		nextmipmap = mipmap;
+		nextcentre = centre;
+		posted = true;
+		cv_post.notify_one();
+	}
+	bool latest(cv::Mat& frame) {
+		// the loupe completed last, if it hasn't been taken yet
+		std::lock_guard<std::mutex> lock(m);
+		if (!fresh) return false;
+		frame = completed;
+		fresh = false;
+		return true;
+	}
+	bool busy() {
+		// whether a post is waiting or rendering
+		std::lock_guard<std::mutex> lock(m);
+		return posted || rendering;
+	}
+private:
+	void run() {
+		std::unique_lock<std::mutex> lock(m);
+		while (true) {
+			cv_post.wait(lock, [this] { return posted || stopping; });
+			if (stopping) break;
+			PreviewParams p = next;
+			bool mipmap = nextmipmap;
+			cv::Point centre = nextcentre;
+			posted = false;
+			rendering = true;
+			lock.unlock();
+			// only one of the placements is kept, for the interpolation in use
+			if (mipmap) {
+				ws.background.release();
+				ws.tmp.release();
+				ws.equirect.release();
+				ws.backgroundkey.clear();
+				ws.pankey.clear();
+				ws.placekey.clear();
+			}
+			else {
+				pyramid.levels.clear();
+				pyramid.key.clear();
+			}
+			cv::Rect roi(centre.x - LOUPE_SIZE/2, centre.y - LOUPE_SIZE/2, LOUPE_SIZE, LOUPE_SIZE);
+			cv::Mat frame;
+			try {
+				frame = equirectToFisheyeRoi(source, p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down, outputw, roi, ws,
+					mipmap ? &pyramid : NULL).clone();
+			} catch (...) {
+				std::cout << "Exception occurred in the loupe render!" << std::endl;
+			}
+			lock.lock();
+			rendering = false;
+			if (frame.empty()) continue;
+			completed = frame;
+			fresh = true;
+		}
+	}
+	cv::Mat source;
+	int outputw;
+	// used by the worker only
+	RenderWorkspace ws;
+	SourcePyramid pyramid;
+	PreviewParams next;
+	bool nextmipmap;
+	cv::Point nextcentre;
+	std::vector<int> lastkey;
+	bool posted, stopping, fresh;
+	// whether the worker is rendering a post
+	bool rendering;
+	cv::Mat completed;
+	std::mutex m;
+	std::condition_variable cv_post;
+	std::thread worker;
+};
+
+//////////////////////////////////////////////
+// Background render for Save. Once the sliders have rested, the full
+// resolution image is rendered on its own thread, so that Save only has
+// to encode it, or to encode the bands already done while waiting for
+// the rest. A change of parameters cancels it at the next band, and it
+// gives way to the preview and the loupe at band boundaries.
+
+// how long the parameters must rest before the background render starts
+#define BACKGROUND_RENDER_DELAY_MS 1500
+// largest output kept in memory for it
+#define BACKGROUND_RENDER_MAX_BYTES ((size_t)1024*1024*1024)
+// how long it sleeps at a band boundary before asking again whether it may go on
+#define BACKGROUND_YIELD_MS 10
+
+class BackgroundRender
+{
+public:
+	BackgroundRender(cv::Mat source, int outputw, std::function<bool()> interactive = nullptr) :
+		source(source), outputw(outputw), interactive(interactive), rowsdone(0), finished(false), generation(0) {}
+	~BackgroundRender() { stop(); }
+	bool matches(const std::vector<int>& k) {
+		std::lock_guard<std::mutex> lock(m);
+		return !key.empty() && k == key;
+	}
+	bool start(const std::vector<int>& k, const PreviewParams& p, bool mipmap, bool full) {
+		// k identifies p and mipmap, for matches() and writeTo(). With full, it renders
+		// the whole frame with equirectToFisheye, as a save would (see saveRendersFull).
+		// Doesn't wait for an earlier render: while that one is still giving up,
+		// this returns false, and the caller tries again later.
+		cancel();
+		if (worker.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(m);
+				if (!finished) return false;
+			}
+			worker.join();
+		}
+		std::cout << "Rendering " << outputw << "x" << outputw << " in the background" << std::endl;
+		// the full frame render allocates its own
+		if (!full) result.create(outputw, outputw, CV_8UC3);
+		rowsdone = 0;
+		finished = false;
+		key = k;
+		worker = std::thread(&BackgroundRender::run, this, p, mipmap, full, (unsigned long)generation);
+		return true;
+	}
+	void cancel() {
+		// doesn't wait, the render gives up before its next stage or band.
+		// The result is released here once the render has finished, or by the render
+		// as it gives up, so that it isn't kept while a save for other parameters runs
+		generation++;
+		std::lock_guard<std::mutex> lock(m);
+		key.clear();
+		if (finished) result.release();
+	}
+	bool writeTo(const std::vector<int>& k, StripWriter& writer, bool& written, SaveProgress* progress = NULL) {
+		// writes the render for k as its bands complete. Returns false if there is
+		// no render for k, and the caller has to render it itself.
+		std::unique_lock<std::mutex> lock(m);
+		if (key.empty() || k != key) return false;
+		written = false;
+		// a reference of its own, in case the render is cancelled and releases result
+		cv::Mat rows = result;
+		int y = 0;
+		while (y < outputw) {
+			cv_rows.wait(lock, [&] { return rowsdone > y || finished; });
+			if (rowsdone <= y) return true;
+			int to = rowsdone;
+			if (progress) {
+				progress->stage = SAVE_RENDERING;
+				progress->rendered = to;
+			}
+			lock.unlock();
+			if (rows.empty()) rows = result;
+			bool ok = writer.writeRows(rows.rowRange(y, to));
+			lock.lock();
+			if (!ok) return true;
+			y = to;
+		}
+		written = true;
+		return true;
+	}
+private:
+	void stop() {
+		cancel();
+		if (worker.joinable()) worker.join();
+	}
+	void run(PreviewParams p, bool mipmap, bool full, unsigned long mine) {
+		// The remaps go through OpenCV's shared thread pool, which a nice level on this
+		// thread would not reach, so instead it waits before each stage or band
+		// while the preview or the loupe has a render waiting or running
+		std::function<bool()> cancelled = [&] {
+			while (generation == mine && interactive && interactive())
+				std::this_thread::sleep_for(std::chrono::milliseconds(BACKGROUND_YIELD_MS));
+			return generation != mine;
+		};
+		if (full) {
+			RenderWorkspace ws;
+			cv::Mat dst = equirectToFisheye(source, p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down, outputw, ws,
+				true, cancelled);
+			std::lock_guard<std::mutex> lock(m);
+			if (!dst.empty()) {
+				result = dst;
+				rowsdone = outputw;
+			}
+		}
+		else {
+			equirectToFisheyeBanded(source, p.sky_threshold, p.horizontal_extent, p.move_down, p.rotate_down, outputw, BAND_HEIGHT,
+				mipmap ? &pyramid : NULL, [&](const cv::Mat& band, int firstrow) {
+					if (generation != mine) return false;
+					band.copyTo(result.rowRange(firstrow, firstrow + band.rows));
+					std::lock_guard<std::mutex> lock(m);
+					rowsdone = firstrow + band.rows;
+					cv_rows.notify_all();
+					return true;
+				}, cancelled);
+		}
+		std::lock_guard<std::mutex> lock(m);
+		if (generation != mine) result.release();
+		finished = true;
+		cv_rows.notify_all();
+	}
+	cv::Mat source;
+	int outputw;
+	// whether the preview or the loupe has work, which the render waits for
+	std::function<bool()> interactive;
+	// kept between renders with the same placement, used by the worker only
+	SourcePyramid pyramid;
+	cv::Mat result;
+	std::vector<int> key;
+	int rowsdone;
+	bool finished;
+	std::atomic<unsigned long> generation;
+	std::mutex m;
+	std::condition_variable cv_rows;
+	std::thread worker;
+};
+
+class SaveJob
+{
+	// runs a save on its own thread, so that the window stays live while it writes
+public:
+	SaveJob() : running(false), result(false) {}
+	~SaveJob() {
+		// lets a save in progress finish
+		if (worker.joinable()) worker.join();
+	}
+	bool busy() const { return running; }
+	void start(const std::string& savepath, std::function<bool(SaveProgress&)> work) {
+		if (worker.joinable()) worker.join();
+		progress.stage = SAVE_PREPARING;
+		progress.rendered = 0;
+		progress.encoded = 0;
+		progress.cancel = false;
+		progress.opened = false;
+		path = savepath;
+		running = true;
+		worker = std::thread([this, work] {
+			bool ok = work(progress);
+			if (!ok && (progress.cancel || progress.opened)) {
+				// no half written files, whether cancelled or failed
+				remove(path.c_str());
+			}
+			result = ok;
+			progress.stage = SAVE_DONE;
+			running = false;
+		});
+	}
+	void cancel() { progress.cancel = true; }
+	bool finished(bool& written, bool& cancelled) {
+		// true once for each save, when it has ended
+		if (running || !worker.joinable()) return false;
+		worker.join();
+		written = result;
+		cancelled = progress.cancel;
+		return true;
+	}
+	const std::string& savepath() const { return path; }
+	SaveProgress progress;
+private:
+	std::atomic<bool> running, result;
+	std::string path;
+	std::thread worker;
+};
+
+#ifndef PAN2FULLDOME_CLI
+//////////////////////////////////////////////
+// Settings remembered between sessions, and in-window dialogs.
+// tinyfd runs zenity or kdialog as a subprocess for every prompt on Linux,
+// which is slow to appear. With --in-window, the file, the output width
+// and the save path are asked for in the cvui window instead, and that
+// choice is remembered too, until --system-dialogs.
+
+struct Settings {
+	// the directory the last pan was opened from
+	std::string pandir = ".";
+	int outputw = 1024;
+	int sky_threshold = 0;
+	int horizontal_extent = 360;
+	int move_down = 0;
+	int rotate_down = -160;
+	bool mipmap = false;
+	// in-window dialogs instead of tinyfd
+	bool inwindow = false;
+};
+
+std::string settingsPath()
+{
+	// ~/.pan2fulldome, or in the working directory if there is no home
+	const char* home = getenv("HOME");
+#ifdef _WIN32
+	if (!home) home = getenv("USERPROFILE");
+#endif
+	return std::string(home ? home : ".") + "/.pan2fulldome";
+}
+
+void loadSettings(Settings& s)
+{
+	// key=value lines, unknown keys are ignored. Leaves s as it is if there is no file
+	std::ifstream f(settingsPath());
+	std::string line;
+	while (std::getline(f, line)) {
+		std::string::size_type eq = line.find('=');
+		if (eq == std::string::npos) continue;
+		std::string key = line.substr(0, eq);
+		std::string value = line.substr(eq + 1);
+		int n = atoi(value.c_str());
+		// the same limits as the trackbars in main()
+		if (key == "pandir") s.pandir = value;
+		else if (key == "outputw" && n > 0) s.outputw = n;
+		else if (key == "sky_threshold") s.sky_threshold = std::min(std::max(n, 0), 395);
+		else if (key == "horizontal_extent") s.horizontal_extent = std::min(std::max(n, 5), 360);
+		else if (key == "move_down") s.move_down = std::min(std::max(n, 0), 395);
+		else if (key == "rotate_down") s.rotate_down = std::min(std::max(n, -180), 180);
+		else if (key == "mipmap") s.mipmap = n != 0;
+		else if (key == "inwindow") s.inwindow = n != 0;
+	}
+}
+
+void saveSettings(const Settings& s)
+{
+	std::ofstream f(settingsPath());
+	f << "pandir=" << s.pandir << std::endl
+		<< "outputw=" << s.outputw << std::endl
+		<< "sky_threshold=" << s.sky_threshold << std::endl
+		<< "horizontal_extent=" << s.horizontal_extent << std::endl
+		<< "move_down=" << s.move_down << std::endl
+		<< "rotate_down=" << s.rotate_down << std::endl
+		<< "mipmap=" << (int)s.mipmap << std::endl
+		<< "inwindow=" << (int)s.inwindow << std::endl;
+	if (!f) std::cout << "Could not write the settings: " << settingsPath() << std::endl;
+}
+
+std::string directoryOf(const std::string& path)
+{
+	std::string::size_type i = path.find_last_of("/\\");
+	if (i == std::string::npos) return ".";
+	if (i == 0) return "/";
+	return path.substr(0, i);
+}
+
+std::string parentDirectory(const std::string& dir)
+{
+	// strips the last component, or appends .. where that would not go up
+	std::string::size_type i = dir.find_last_of("/\\");
+	std::string last = (i == std::string::npos) ? dir : dir.substr(i + 1);
+	if (!last.empty() && last.back() == ':') return dir;	// a drive
+	if (last.empty() || last == "." || last == "..") return dir + "/..";
+	return directoryOf(dir);
+}
+
+bool isDirectory(const std::string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+struct DirEntry {
+	std::string name;
+	bool dir;
+};
+
+std::vector<DirEntry> listDirectory(const std::string& dir)
+{
+	// the subdirectories and the images which readPan() can open, directories first,
+	// with ".." to go up
+	std::vector<std::string> names;
+#ifdef _WIN32
+	struct _finddata_t fd;
+	intptr_t h = _findfirst((dir + "/*").c_str(), &fd);
+	if (h != -1) {
+		do {
+			names.push_back(fd.name);
+		} while (_findnext(h, &fd) == 0);
+		_findclose(h);
+	}
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d) {
+		while (struct dirent* e = readdir(d)) {
+			names.push_back(e->d_name);
+		}
+		closedir(d);
+	}
+#endif
+	std::vector<DirEntry> entries;
+	entries.push_back({ "..", true });
+	for (const std::string& name : names) {
+		if (name == "." || name == "..") continue;
+		if (isDirectory(dir + "/" + name)) {
+			entries.push_back({ name, true });
+			continue;
+		}
+		std::string ext = lowercaseExtension(name);
+		if (ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "tif" || ext == "tiff") {
+			entries.push_back({ name, false });
+		}
+	}
+	std::sort(entries.begin() + 1, entries.end(), [](const DirEntry& a, const DirEntry& b) {
+		if (a.dir != b.dir) return a.dir;
+		return a.name < b.name;
+	});
+	return entries;
+}
+
+static bool inputFocused()
+{
+	// while an input has the focus, cvui reads the keys itself in imshow(),
+	// so the dialog loops must not take them with cv::waitKey
+	return !cvui::internal::gInput.name.empty();
+}
+
+static void releaseFocus()
+{
+	// cvui only drops the focus on a click, so a dialog closed with Enter
+	// or ESC would leave it set, and the main window's imshow would go on
+	// swallowing the keys, ESC included
+	cvui::internal::gInput.name = "";
+}
+
+bool inWindowText(const std::string& prompt, std::string& value)
+{
+	// a one line text prompt in the main window, in place of tinyfd_inputBox.
+	// Returns false on Cancel or ESC, leaving value as it was
+	cv::Mat frame = cv::Mat(680, 680, CV_8UC3);
+	cv::String text = value;
+	while (true) {
+		frame = cv::Scalar(49, 52, 49);
+		cvui::text(frame, 20, 20, prompt);
+		cvui::text(frame, 20, 40, "Click the box to type, Enter or OK when done");
+		int key = cvui::input(frame, 20, 60, 640, "text", text);
+		bool ok = cvui::button(frame, 20, 100, "OK") || key == (int)cvui::KEY_ENTER;
+		// ESC comes back from the input while it has the focus, and from waitKey otherwise
+		bool cancel = cvui::button(frame, 80, 100, "Cancel") || key == 27;
+		cvui::imshow(WINDOW_NAME, frame);
+		if (!ok && !cancel && !inputFocused() && cv::waitKey(20) == 27) cancel = true;
+		if (ok || cancel) {
+			releaseFocus();
+			if (ok) value = text;
+			return ok;
+		}
+	}
+}
+
+void inWindowMessage(const std::string& msg)
+{
+	// in place of tinyfd_messageBox, one sentence per line
+	cv::Mat frame = cv::Mat(680, 680, CV_8UC3);
+	while (true) {
+		frame = cv::Scalar(49, 52, 49);
+		int y = 20;
+		std::string::size_type start = 0;
+		while (start < msg.size()) {
+			std::string::size_type end = msg.find(". ", start);
+			end = (end == std::string::npos) ? msg.size() : end + 1;
+			cvui::text(frame, 20, y, msg.substr(start, end - start));
+			y += 20;
+			start = end + 1;
+		}
+		bool ok = cvui::button(frame, 20, y + 10, "OK");
+		cvui::imshow(WINDOW_NAME, frame);
+		if (ok || cv::waitKey(20) == 27) return;
+	}
+}
+
+// entries shown at a time by inWindowOpenFile
+#define FILE_LIST_ROWS 20
+
+std::string inWindowOpenFile(const std::string& title, std::string& dir)
+{
+	// a list of the images and directories in dir, in place of tinyfd_openFileDialog.
+	// Clicking a directory lists it, clicking an image returns its path, and a path
+	// can also be typed. dir is left at the directory listed last.
+	// Returns "" on Cancel or ESC
+	cv::Mat frame = cv::Mat(680, 680, CV_8UC3);
+	std::vector<DirEntry> entries;
+	std::string listed;
+	cv::String typed;
+	int first = 0;
+	while (true) {
+		if (listed != dir) {
+			entries = listDirectory(dir);
+			listed = dir;
+			typed = dir;
+			first = 0;
+		}
+		frame = cv::Scalar(49, 52, 49);
+		cvui::text(frame, 20, 15, title);
+		std::string chosen;
+		int key = cvui::input(frame, 20, 35, 640, "path", typed);
+		if (key == (int)cvui::KEY_ENTER) {
+			if (isDirectory(typed)) dir = typed;
+			else chosen = typed;
+		}
+		for (int k = 0; k < FILE_LIST_ROWS && first + k < (int)entries.size(); k++) {
+			const DirEntry& e = entries[first + k];
+			int y = 75 + 25 * k;
+			int area = cvui::iarea(20, y, 640, 22);
+			if (area == cvui::OVER || area == cvui::DOWN) cvui::rect(frame, 20, y, 640, 22, 0x4a4d4a, 0x4a4d4a);
+			cvui::text(frame, 25, y + 6, e.dir ? e.name + "/" : e.name);
+			if (area == cvui::CLICK) {
+				if (!e.dir) chosen = dir + "/" + e.name;
+				else if (e.name == "..") dir = parentDirectory(dir);
+				else dir = dir + "/" + e.name;
+			}
+		}
+		if (cvui::button(frame, 20, 585, "Up") && first > 0) first = std::max(first - FILE_LIST_ROWS, 0);
+		if (cvui::button(frame, 80, 585, "Down") && first + FILE_LIST_ROWS < (int)entries.size()) first += FILE_LIST_ROWS;
+		bool cancel = cvui::button(frame, 20, 630, "Cancel") || key == 27;
+		cvui::imshow(WINDOW_NAME, frame);
+		if (chosen.empty() && !cancel && !inputFocused() && cv::waitKey(20) == 27) cancel = true;
+		if (!chosen.empty() || cancel) {
+			releaseFocus();
+			return cancel ? "" : chosen;
+		}
+	}
+}
+
+int main(int argc,char *argv[])
+{
+bool doneflag = 0;
+bool showdisplay = 1, interactivemode=0;
+bool skipinputs = 0;
+int outputw;
+std::string PanFileName;
+std::string NAME;
+float aspectratio[100];
+int looptemp=0;
+std::string escapedpath;
 std::string escapedsavepath;
     
 char const * lTmp;
@@ -346,16 +3189,58 @@ cv::Size Sout;
 std::vector<cv::Mat> spl;
 cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 
+// memory budget for rendering, from --max-memory in MB, 0 for none
+size_t maxmemory = 0;
+// how the preview keeps its maps, from --map-storage float|fixed16
+MapStorage mapstorage = MAP_FLOAT;
+// the last session's choices
+Settings settings;
+loadSettings(settings);
+
+    for (int k = 1; k < argc; k++)
+    {
+		std::string arg = argv[k];
+		if (arg == "--in-window") {
+			settings.inwindow = true;
+		}
+		else if (arg == "--system-dialogs") {
+			settings.inwindow = false;
+		}
+		else if (arg == "--max-memory" && k + 1 < argc) {
+			maxmemory = (size_t)atol(argv[++k]) * 1024 * 1024;
+		}
+		else if (arg == "--map-storage" && k + 1 < argc) {
+			std::string storage = argv[++k];
+			mapstorage = (storage == "fixed16") ? MAP_FIXED16 : MAP_FLOAT;
+		}
+		else {
+			// argument can be ini file path
+			escapedpath = arg;
+		}
+    }
     
-    if(argc <= 1)
+    if (settings.inwindow) {
+		// Init cvui and tell it to create a OpenCV window, i.e. cv::namedWindow(WINDOW_NAME).
+		cvui::init(WINDOW_NAME);
+	}
+    if(escapedpath.empty() && settings.inwindow)
+    {
+		std::string chosen = inWindowOpenFile("Open input pan image file", settings.pandir);
+		if (!chosen.empty()) {
+			skipinputs = 1;
+			escapedpath = escaped(chosen);
+		}
+	}
+    else if(escapedpath.empty())
     {
-		char const * FilterPatternsimg[2] =  { "*.jpg","*.png" };
+		char const * FilterPatternsimg[4] =  { "*.jpg","*.png","*.tif","*.tiff" };
 		char const * OpenFileNameimg;
+		std::string defaultpath = settings.pandir + "/";
 		
 		OpenFileNameimg = tinyfd_openFileDialog(
 				"Open input pan image file",
-				"",
-				2,
+				defaultpath.c_str(),
+				4,
 				FilterPatternsimg,
 				NULL,
 				0);
@@ -370,13 +3255,10 @@ cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 			escapedpath = escaped(std::string(OpenFileNameimg));
 		}
 	} // end if arc <= 1
-	    
-    if(argc > 1)
-    {
-		// argument can be ini file path
+	else
+	{
 		skipinputs = 1;
-		escapedpath = argv[1];
-    }
+	}
 	// https://www.oreilly.com/library/view/c-cookbook/0596007612/ch10s17.html
 	
     escapedsavepath = escapedpath;
@@ -392,45 +3274,230 @@ cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 	
     if(skipinputs==1)
     {	
-	lTmp = tinyfd_inputBox(
-		"Please Input", "Output image width (=height)", "1024");
-	if (!lTmp) return 1 ;
+	settings.pandir = directoryOf(escapedpath);
+	std::string widthtext = std::to_string(settings.outputw);
+	if (settings.inwindow) {
+		if (!inWindowText("Output image width (=height)", widthtext)) return 1;
+	}
+	else {
+		lTmp = tinyfd_inputBox(
+			"Please Input", "Output image width (=height)", widthtext.c_str());
+		if (!lTmp) return 1 ;
+		widthtext = lTmp;
+	}
 	
-	outputw = atoi(lTmp);
-	cv::Mat img = cv::imread(escapedpath, cv::IMREAD_COLOR);
+	outputw = atoi(widthtext.c_str());
+	if (outputw <= 0) return 1;
+	settings.outputw = outputw;
+	saveSettings(settings);
+	// the source is only needed at the intermediate width for the preview or the output
+	int neededwidth = std::max(intermediateSize(PREVIEW_WIDTH).width, intermediateSize(outputw).width);
+	// preflight, before anything large is allocated
+	cv::Size decodedsize = decodedPanSize(escapedpath, neededwidth);
+	RenderMode savemode;
+	int savebandh;
+	bool savefits = fitSaveMode(decodedsize, outputw, maxmemory, canStreamTo(escapedsavepath), settings.mipmap, savemode, savebandh);
+	std::cout << "Estimated peak memory for saving " << outputw << "x" << outputw << ", " << renderModeName(savemode)
+		<< ": " << estimatePeakBytes(decodedsize, outputw, savemode, savebandh, settings.mipmap) / (1024*1024) << " MB" << std::endl;
+	if (!savefits) {
+		std::string msg = "Output width " + std::to_string(outputw) + " needs more than the memory budget of "
+			+ std::to_string(maxmemory / (1024*1024)) + " MB. Please choose a smaller width.";
+		std::cout << msg << std::endl;
+		if (settings.inwindow) inWindowMessage(msg);
+		else tinyfd_messageBox("pan2fulldome", msg.c_str(), "ok", "error", 1);
+		return 1;
+	}
+	// The window opens at once, and the full decode, for Save and the loupe, runs on its
+	// own thread. When libjpeg can decode at a smaller scale for the preview than for the
+	// output, the preview starts from that reduced decode. Otherwise, as for PNGs, TIFFs
+	// (whose reduced read would pass over the whole file as well) and JPEGs small enough
+	// to decode at full scale, the preview stays black until the full decode is done.
+	cv::Mat img, proxy;
+	std::future<cv::Mat> fullread;
+	// if the full decode fails, the preview stays up, without Save
+	bool fullreadfailed = false;
+	int previewneededwidth = intermediateSize(PREVIEW_WIDTH).width;
+	std::string inext = lowercaseExtension(escapedpath);
+	if ((inext == "jpg" || inext == "jpeg") && decodedPanSize(escapedpath, previewneededwidth).width < decodedsize.width) {
+		proxy = previewProxy(readPan(escapedpath, previewneededwidth));
+		if(proxy.empty())
+			 {
+			 std::cout << "Could not read the image: " << escapedpath << std::endl;
+			 return 1;
+			 }
+	}
+	fullread = std::async(std::launch::async, readPan, escapedpath, neededwidth);
 		
 	cv::Size dstdisplaysize = cv::Size(400,400);
 	cv::Size dstsize = cv::Size(outputw,outputw);
 	
-	dstdisplay = equirectToFisheye(img, 0, 360, 0, -160, 400);
-	
-	if(img.empty())
-		 {
-		 std::cout << "Could not read the image: " << escapedpath << std::endl;
-		 return 1;
-		 }
+	// previews are rendered on a worker thread, black until the first one is done
+	PreviewRenderer preview(proxy, mapstorage);
+	// and the full resolution render is started ahead of Save, if it fits in memory.
+	// These need the full image, and are created once it is read.
+	RenderMode backgroundmode;
+	int backgroundbandh;
+	bool backgroundok = false;
+	// the loupe before the background render, which asks it whether it is busy
+	std::unique_ptr<LoupeRenderer> loupe;
+	std::unique_ptr<BackgroundRender> background;
+	cv::Mat loupedisplay;
+	dstdisplay = cv::Mat(PREVIEW_WIDTH, PREVIEW_WIDTH, CV_8UC3, cv::Scalar(0, 0, 0));
 	
 	////////// CVUI ///////////////
 	// Create a frame where components will be rendered to.
 	cv::Mat frame = cv::Mat(680, 680, CV_8UC3);
-	int sky_threshold = 0;
-	int horizontal_extent = 360;
-	int move_down = 0;
-	int rotate_down = -160;
+	int sky_threshold = settings.sky_threshold;
+	int horizontal_extent = settings.horizontal_extent;
+	int move_down = settings.move_down;
+	int rotate_down = settings.rotate_down;
+	// the slider moved last, for the speculative renders
+	int lastslider = SLIDER_NONE;
+	preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, false, lastslider });
+	// whether the last post was a draft, which needs a full quality render on release
+	bool draftposted = false;
+	// the parameters of the save, and since when they haven't changed
+	std::vector<int> savekey;
+	int64 savekeysince = cv::getTickCount();
 
 	// Init cvui and tell it to create a OpenCV window, i.e. cv::namedWindow(WINDOW_NAME).
-	cvui::init(WINDOW_NAME);
+	if (!settings.inwindow) cvui::init(WINDOW_NAME);
 	bool sky_checked = true;
 	bool black_checked = false;
 	bool simple_checked = false;
+	bool mipmap_checked = settings.mipmap;
+	bool loupe_checked = false;
+	// the mip-mapped intermediate, kept between saves with the same placement
+	SourcePyramid savepyramid;
+	// saves run on their own thread
+	SaveJob savejob;
+
+	// the parts of the frame that never change are drawn once
+	cv::Mat staticframe = cv::Mat(680, 680, CV_8UC3, cv::Scalar(49, 52, 49));
+	cvui::text(staticframe, 350, 10, "Preview");
+	cvui::text(staticframe, 35, 580, "Sky");
+	cvui::text(staticframe, 170, 580, "Horizontal extent");
+	cvui::text(staticframe, 335, 580, "Move down");
+	cvui::text(staticframe, 485, 580, "Rotate down");
+	// what the last drawn frame showed, to tell whether it needs drawing again
+	bool redraw = true;
+	cv::Point lastmouse(-1, -1);
+	bool lastdragging = false;
+	std::vector<int> lastprogress;
 
 	while (true) {
-		// Fill the frame with a nice color
-		frame = cv::Scalar(49, 52, 49);
+		if (fullread.valid() && fullread.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+			img = fullread.get();
+			if (img.empty()) {
+				std::cout << "Could not read the image: " << escapedpath << std::endl;
+				// with nothing to preview either, there is nothing to do
+				if (proxy.empty()) return 1;
+				fullreadfailed = true;
+			}
+			else if (proxy.empty()) {
+				proxy = previewProxy(img);
+				preview.setSource(proxy);
+			}
+			redraw = true;
+		}
+		if (!img.empty() && !background) {
+			backgroundok = (size_t)outputw * outputw * 3 <= BACKGROUND_RENDER_MAX_BYTES
+				&& fitSaveMode(img.size(), outputw, maxmemory, false, true, backgroundmode, backgroundbandh);
+			// the loupe keeps its own placement, so only when that fits beside a save
+			if (maxmemory == 0 || estimatePeakBytes(img.size(), outputw, savemode, savebandh, true) + estimateLoupeBytes(outputw) <= maxmemory) {
+				loupe.reset(new LoupeRenderer(img, outputw));
+			}
+			else {
+				std::cout << "No loupe, it would not fit in the memory budget beside a save" << std::endl;
+			}
+			background.reset(new BackgroundRender(img, outputw, [&] { return preview.busy() || (loupe && loupe->busy()); }));
+		}
+
+		// slider changes while the button is held are drafts
+		bool dragging = cvui::mouse(cvui::LEFT_BUTTON, cvui::IS_DOWN);
+		if (draftposted && !dragging) {
+			preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, false, lastslider });
+			draftposted = false;
+		}
+
+		// once the parameters have rested, the background render starts, and any change cancels it.
+		// Not while a save is running, which may be taking its bands from it.
+		std::vector<int> currentkey = { sky_threshold, horizontal_extent, move_down, rotate_down, (int)mipmap_checked };
+		if (!savejob.busy() && background) {
+			if (currentkey != savekey) {
+				savekey = currentkey;
+				savekeysince = cv::getTickCount();
+				background->cancel();
+			}
+			else if (backgroundok && !dragging && !background->matches(savekey)
+				&& (cv::getTickCount() - savekeysince) * 1000. / cv::getTickFrequency() > BACKGROUND_RENDER_DELAY_MS) {
+				background->start(savekey, { sky_threshold, horizontal_extent, move_down, rotate_down, false, lastslider }, mipmap_checked,
+					saveRendersFull(img.size(), outputw, maxmemory, mipmap_checked));
+			}
+		}
+
+		bool written, cancelled;
+		if (savejob.finished(written, cancelled)) {
+			if (cancelled) {
+				std::cout << "Save cancelled: " << savejob.savepath() << std::endl;
+			}
+			else if (!written) {
+				std::cout << "Could not write the image: " << savejob.savepath() << std::endl;
+			}
+			else {
+				std::cout << "Saved " << savejob.savepath() << std::endl;
+			}
+		}
+
+		// the frame is drawn again only for mouse input, a new preview, or save progress,
+		// otherwise the loop just waits for events
+		if (preview.latest(dstdisplay)) redraw = true;
+		cv::Point mouse = cvui::mouse();
+		// the loupe follows the mouse over the preview, centred on the output pixel under it
+		const cv::Rect previewrect(140, 30, PREVIEW_WIDTH, PREVIEW_WIDTH);
+		const bool loupeshown = loupe_checked && loupe && previewrect.contains(mouse);
+		if (loupeshown) {
+			cv::Point centre((2*(mouse.x - previewrect.x) + 1) * outputw / (2*PREVIEW_WIDTH),
+				(2*(mouse.y - previewrect.y) + 1) * outputw / (2*PREVIEW_WIDTH));
+			loupe->post({ sky_threshold, horizontal_extent, move_down, rotate_down, false, SLIDER_NONE }, mipmap_checked, centre);
+		}
+		if (loupe && loupe->latest(loupedisplay)) redraw = true;
+		if (mouse != lastmouse || dragging != lastdragging || cvui::mouse(cvui::DOWN) || cvui::mouse(cvui::UP)) {
+			redraw = true;
+		}
+		std::vector<int> progress;
+		if (savejob.busy()) {
+			progress = { (int)savejob.progress.stage, (int)savejob.progress.rendered, (int)savejob.progress.encoded };
+		}
+		if (progress != lastprogress) redraw = true;
+		if (!redraw) {
+			if (cv::waitKey(20) == 27) { // ESC was pressed
+				break;
+			}
+			continue;
+		}
+		redraw = false;
+		lastmouse = mouse;
+		lastdragging = dragging;
+		lastprogress = progress;
 
 		// Render UI components to the frame
-		cvui::text(frame, 350, 10, "Preview");
-		cvui::button(frame, 140, 30, dstdisplay, dstdisplay, dstdisplay);
+		staticframe.copyTo(frame);
+		dstdisplay.copyTo(frame(cv::Rect(140, 30, dstdisplay.cols, dstdisplay.rows)));
+
+		// where the time of the recent previews went, stage by stage
+		std::vector<double> times[RENDER_STAGES + 1];
+		preview.stageTimes(times);
+		for (int s = 0; s <= RENDER_STAGES; s++) {
+			int y = 30 + 36 * s;
+			cvui::printf(frame, 5, y, 0.35, 0xcecece, "%s %.1f ms", s < RENDER_STAGES ? renderStageName(s) : "total",
+				times[s].empty() ? 0. : times[s].back());
+			// the sparkline scales between min and max, which must differ
+			if (times[s].size() >= 2 && *std::max_element(times[s].begin(), times[s].end()) > *std::min_element(times[s].begin(), times[s].end())) {
+				cvui::sparkline(frame, times[s], 5, y + 12, 125, 20, s < RENDER_STAGES ? 0x00ff00 : 0xffff00);
+			}
+		}
+		cvui::checkbox(frame, 5, 290, "Loupe", &loupe_checked);
 
 		
 		cvui::checkbox(frame, 40, 540, "Interp sky", &sky_checked);
@@ -446,64 +3513,172 @@ cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 			sky_checked = true;
 		}
 		cvui::checkbox(frame, 350, 540, "Simple polar", &simple_checked);
+		cvui::checkbox(frame, 510, 540, "Antialias save", &mipmap_checked);
 		
-		cvui::text(frame, 35, 580, "Sky");
 		if (cvui::trackbar(frame, 15, 600, 135, &sky_threshold, 0, 400)) {
 			if (sky_threshold > 395) { 
 				sky_threshold = 395;  // to prevent crashes
 			}
-			dstdisplay = equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, 400);
+			lastslider = SLIDER_SKY;
+			preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, dragging, lastslider });
+			draftposted = dragging;
 		}
 
-		cvui::text(frame, 170, 580, "Horizontal extent");
 		if (cvui::trackbar(frame, 165, 600, 135, &horizontal_extent, 1, 360)) {
 			if (horizontal_extent < 5) {
 				horizontal_extent = 5;   // to prevent crashes
 			}
-			dstdisplay = equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, 400);
+			lastslider = SLIDER_EXTENT;
+			preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, dragging, lastslider });
+			draftposted = dragging;
 		}
 
-		cvui::text(frame, 335, 580, "Move down");
 		if (cvui::trackbar(frame, 315, 600, 135, &move_down, 0, 400)) {
 			if (move_down > 395) {
 				move_down = 395;   // to prevent crashes
 			}
-			dstdisplay = equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, 400);
+			lastslider = SLIDER_MOVE_DOWN;
+			preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, dragging, lastslider });
+			draftposted = dragging;
 		}
 
-		cvui::text(frame, 485, 580, "Rotate down");
 		if (cvui::trackbar(frame, 465, 600, 200, &rotate_down, -180, 180)) {
 			if (rotate_down > 355) {
 				rotate_down = 355;   // to prevent crashes
 			}
-			dstdisplay = equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, 400);
+			lastslider = SLIDER_ROTATE_DOWN;
+			preview.post({ sky_threshold, horizontal_extent, move_down, rotate_down, dragging, lastslider });
+			draftposted = dragging;
 		}
 
 		if (cvui::button(frame, 350, 650, "Close")) {
 		    // close button was clicked
 			break;
 		}
-		if (cvui::button(frame, 200, 650, "Save")) {
+		if (savejob.busy()) {
+			// the save runs on, while the sliders can be used for the next one
+			if (cvui::button(frame, 200, 650, "Cancel")) {
+				savejob.cancel();
+			}
+			int stage = savejob.progress.stage;
+			if (stage == SAVE_PREPARING) {
+				cvui::text(frame, 440, 648, "Preparing...");
+			}
+			else if (stage == SAVE_RENDERING) {
+				cvui::printf(frame, 440, 648, "Rendered %d%%, encoded %d%%", 100 * savejob.progress.rendered / outputw, 100 * savejob.progress.encoded / outputw);
+			}
+			else {
+				cvui::text(frame, 440, 648, "Writing the file...");
+			}
+			// rendered rows, and encoded rows over them
+			cvui::rect(frame, 440, 664, 220, 8, 0x808080);
+			cvui::rect(frame, 440, 664, 220 * savejob.progress.rendered / outputw, 8, 0x808080, 0x606060);
+			cvui::rect(frame, 440, 664, 220 * savejob.progress.encoded / outputw, 8, 0x808080, 0xa0a0a0);
+		}
+		else if (fullreadfailed) {
+			cvui::text(frame, 440, 655, "Could not read the full image");
+		}
+		else if (img.empty()) {
+			// the decode can't be interrupted, so Close and ESC wait for it
+			cvui::text(frame, 440, 648, "Reading the full image...");
+			cvui::text(frame, 440, 662, "Closing waits for it to finish");
+		}
+		else if (cvui::button(frame, 200, 650, "Save")) {
 		    // save button was clicked
-		    dst = equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, outputw);
 			// ask for filename
-			char const * FilterPatternsimgsave[2] =  { "*.jpg","*.png" };
-			char const * SaveFileNameimg;
+			char const * FilterPatternsimgsave[4] =  { "*.jpg","*.png","*.tif","*.tiff" };
+			char const * SaveFileNameimg = NULL;
+			std::string savetext = escapedsavepath;
 		
-			SaveFileNameimg = tinyfd_saveFileDialog(
-				"Output image file",
-				"",
-				2,
-				FilterPatternsimgsave,
-				NULL);
+			if (settings.inwindow) {
+				if (inWindowText("Output image file", savetext)) SaveFileNameimg = savetext.c_str();
+				redraw = true;
+			}
+			else {
+				SaveFileNameimg = tinyfd_saveFileDialog(
+					"Output image file",
+					"",
+					4,
+					FilterPatternsimgsave,
+					NULL);
+			}
 
 			if (SaveFileNameimg) {			
 				escapedsavepath = escaped(std::string(SaveFileNameimg));
 				////////////////////
-			    cv::imwrite(escapedsavepath, dst);
+				bool canstream = canStreamTo(escapedsavepath);
+				bool full = saveRendersFull(img.size(), outputw, maxmemory, mipmap_checked);
+				if (!full && !fitSaveMode(img.size(), outputw, maxmemory, canstream, mipmap_checked, savemode, savebandh)) {
+					RenderMode streamed;
+					int streamedbandh;
+					std::string msg = "Saving this file type at " + std::to_string(outputw) + " px needs more than the memory budget of "
+						+ std::to_string(maxmemory / (1024*1024)) + " MB.";
+					if (!canstream && fitSaveMode(img.size(), outputw, maxmemory, true, mipmap_checked, streamed, streamedbandh)) {
+						msg += " Saving as .jpg or .png would fit, since those are streamed.";
+					}
+					std::cout << msg << std::endl;
+					if (settings.inwindow) inWindowMessage(msg);
+					else tinyfd_messageBox("pan2fulldome", msg.c_str(), "ok", "error", 1);
+					redraw = true;
+				}
+				else {
+					// the save gets its own copies of the settings, so that they can change while it runs
+					std::string savepath = escapedsavepath;
+					std::vector<int> key = savekey;
+					int sky = sky_threshold, extent = horizontal_extent, down = move_down, rotate = rotate_down;
+					int bandh = savebandh;
+					bool mipmap = mipmap_checked;
+					savejob.start(savepath, [&, savepath, key, sky, extent, down, rotate, bandh, mipmap, full](SaveProgress& progress) {
+						bool written = false;
+						if (background->matches(key)) {
+							// rendered in the background, or finished while waiting for it
+							std::unique_ptr<StripWriter> writer = openStripWriter(savepath, outputw, outputw, &progress);
+							if (writer && background->writeTo(key, *writer, written, &progress)) {
+								progress.stage = SAVE_FINISHING;
+								return writer->finish() && written;
+							}
+						}
+						if (full) {
+							// rendered whole, as before, and only the encoding is streamed
+							RenderWorkspace ws;
+							cv::Mat dst = equirectToFisheye(img, sky, extent, down, rotate, outputw, ws, true, [&] { return (bool)progress.cancel; });
+							if (dst.empty()) return false;
+							std::unique_ptr<StripWriter> writer = openStripWriter(savepath, outputw, outputw, &progress);
+							if (!writer) return false;
+							progress.stage = SAVE_RENDERING;
+							progress.rendered = outputw;
+							written = writer->writeRows(dst);
+							progress.stage = SAVE_FINISHING;
+							return writer->finish() && written;
+						}
+						// JPEG to JPEG goes through the YCbCr planes when it can
+						if (saveFisheyeYcc(escapedpath, savepath, neededwidth, sky, extent, down, rotate, outputw, bandh, mipmap, written, &progress)) {
+							return written;
+						}
+						std::unique_ptr<StripWriter> writer = openStripWriter(savepath, outputw, outputw, &progress);
+						if (!writer) return false;
+						written = equirectToFisheyeBanded(img, sky, extent, down, rotate, outputw, bandh,
+							mipmap ? &savepyramid : NULL, [&](const cv::Mat& band, int firstrow) {
+								if (progress.cancel) return false;
+								progress.stage = SAVE_RENDERING;
+								progress.rendered = firstrow + band.rows;
+								return writer->writeRows(band);
+							});
+						progress.stage = SAVE_FINISHING;
+						return writer->finish() && written;
+					});
+				}
 			}
 		}
 		
+		// the loupe goes over everything else, beside the cursor and inside the frame
+		if (loupeshown && !loupedisplay.empty()) {
+			int x = std::min(mouse.x + 16, frame.cols - loupedisplay.cols - 1);
+			int y = std::min(mouse.y + 16, frame.rows - loupedisplay.rows - 1);
+			loupedisplay.copyTo(frame(cv::Rect(x, y, loupedisplay.cols, loupedisplay.rows)));
+			cvui::rect(frame, x - 1, y - 1, loupedisplay.cols + 2, loupedisplay.rows + 2, 0xcecece);
+		}
+
 		// Update cvui stuff and show everything on the screen
 		cvui::imshow(WINDOW_NAME, frame);
 
@@ -512,6 +3687,19 @@ cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 		}
 		
 	}
+	// remembered for the next session
+	settings.sky_threshold = sky_threshold;
+	settings.horizontal_extent = horizontal_extent;
+	settings.move_down = move_down;
+	settings.rotate_down = rotate_down;
+	settings.mipmap = mipmap_checked;
+	saveSettings(settings);
+	if (savejob.busy()) {
+		std::cout << "Waiting for the save to finish: " << savejob.savepath() << std::endl;
+	}
+	if (fullread.valid()) {
+		std::cout << "Waiting for the full image to finish reading" << std::endl;
+	}
 
 	return 0;		
 		
@@ -520,3 +3708,147 @@ cv::Mat dst2, dst3, dsts;	// temp dst, for eachvid
 	std::cout << std::endl << "Finished writing." << std::endl;
 	return 0; 
 }
+#elif !defined(PAN2FULLDOME_NO_MAIN)
+//////////////////////////////////////////////
+// Headless command line version, built as pan2fulldome-cli with
+// PAN2FULLDOME_CLI defined: no window, no dialogs, everything from flags,
+// for render nodes and scripts. The tests define PAN2FULLDOME_NO_MAIN as well,
+// to include the renderer without either main.
+
+void printUsage()
+{
+	std::cout << "Usage: pan2fulldome-cli [options] input" << std::endl
+		<< "  --output path              output image, default input name with F.jpg" << std::endl
+		<< "  --outputw n                output width (=height), default 1024" << std::endl
+		<< "  --sky-threshold n          0 to 395, default 0" << std::endl
+		<< "  --horizontal-extent n      5 to 360, default 360" << std::endl
+		<< "  --move-down n              0 to 395, default 0" << std::endl
+		<< "  --rotate-down n            -180 to 180, default -160" << std::endl
+		<< "  --mode m                   auto, full, banded, streamed or polar, default auto" << std::endl
+		<< "  --antialias                mip-map, which renders in bands at any width" << std::endl
+		<< "  --max-memory MB            memory budget for rendering, default none" << std::endl;
+}
+
+int main(int argc,char *argv[])
+{
+	std::string escapedpath, escapedsavepath;
+	int outputw = 1024;
+	// the same defaults and limits as the trackbars of the GUI
+	int sky_threshold = 0;
+	int horizontal_extent = 360;
+	int move_down = 0;
+	int rotate_down = -160;
+	std::string mode = "auto";
+	// off by default, as in the GUI
+	bool mipmap = false;
+	size_t maxmemory = 0;
+	for (int k = 1; k < argc; k++) {
+		std::string arg = argv[k];
+		bool hasvalue = k + 1 < argc;
+		if (arg == "--output" && hasvalue) escapedsavepath = escaped(argv[++k]);
+		else if (arg == "--outputw" && hasvalue) outputw = atoi(argv[++k]);
+		else if (arg == "--sky-threshold" && hasvalue) sky_threshold = std::min(std::max(atoi(argv[++k]), 0), 395);
+		else if (arg == "--horizontal-extent" && hasvalue) horizontal_extent = std::min(std::max(atoi(argv[++k]), 5), 360);
+		else if (arg == "--move-down" && hasvalue) move_down = std::min(std::max(atoi(argv[++k]), 0), 395);
+		else if (arg == "--rotate-down" && hasvalue) rotate_down = std::min(std::max(atoi(argv[++k]), -180), 180);
+		else if (arg == "--mode" && hasvalue) mode = argv[++k];
+		else if (arg == "--antialias") mipmap = true;
+		else if (arg == "--max-memory" && hasvalue) maxmemory = (size_t)atol(argv[++k]) * 1024 * 1024;
+		else if (arg.size() > 1 && arg[0] == '-') {
+			printUsage();
+			return 1;
+		}
+		else escapedpath = escaped(arg);
+	}
+	if (escapedpath.empty() || outputw <= 0
+		|| (mode != "auto" && mode != "full" && mode != "banded" && mode != "streamed" && mode != "polar")) {
+		printUsage();
+		return 1;
+	}
+	if (escapedsavepath.empty()) {
+		// as the GUI suggests it
+		escapedsavepath = escapedpath;
+		std::string::size_type i = escapedsavepath.rfind('.', escapedsavepath.length());
+		if (i != std::string::npos) escapedsavepath.replace(i, 5, "F.jpg");
+		else escapedsavepath = escapedsavepath + "F.jpg";
+	}
+
+	// the extent is fixed for the run, so a partial pan can be decoded smaller
+	int neededwidth = placedPanWidth(horizontal_extent, outputw);
+	cv::Size decodedsize = decodedPanSize(escapedpath, neededwidth);
+	bool canstream = canStreamTo(escapedsavepath);
+	RenderMode savemode;
+	int savebandh;
+	bool fits = fitSaveMode(decodedsize, outputw, maxmemory, canstream, mipmap, savemode, savebandh);
+	if (mode == "auto" && saveRendersFull(decodedsize, outputw, maxmemory, mipmap)) {
+		// as the GUI saves it
+		savemode = RENDER_FULL;
+		fits = true;
+	}
+	if (mode == "full") savemode = RENDER_FULL;
+	else if (mode == "banded") savemode = RENDER_BANDED;
+	else if (mode == "streamed") {
+		if (!canstream) {
+			std::cout << "Only .jpg and .png outputs can be streamed: " << escapedsavepath << std::endl;
+			return 1;
+		}
+		savemode = RENDER_STREAMED;
+	}
+	if (mode != "polar") {
+		size_t peak = estimatePeakBytes(decodedsize, outputw, savemode, savebandh, mipmap);
+		std::cout << "Estimated peak memory for saving " << outputw << "x" << outputw << ", " << renderModeName(savemode)
+			<< ": " << peak / (1024*1024) << " MB" << std::endl;
+		if (mode == "auto" ? !fits : (maxmemory != 0 && peak > maxmemory)) {
+			std::cout << "Output width " << outputw << " needs more than the memory budget of "
+				<< maxmemory / (1024*1024) << " MB." << std::endl;
+			return 1;
+		}
+	}
+
+	bool written = false;
+	// only for telling whether the output file was opened
+	SaveProgress progress;
+	// JPEG to JPEG goes through the YCbCr planes when it can
+	bool ycc = ((mode == "auto" && savemode != RENDER_FULL) || mode == "streamed")
+		&& saveFisheyeYcc(escapedpath, escapedsavepath, neededwidth, sky_threshold, horizontal_extent, move_down, rotate_down,
+			outputw, savebandh, mipmap, written, &progress);
+	if (!ycc) {
+		cv::Mat img = readPan(escapedpath, neededwidth);
+		if (img.empty()) {
+			std::cout << "Could not read the image: " << escapedpath << std::endl;
+			return 1;
+		}
+		try {
+			if (mode == "polar") {
+				written = cv::imwrite(escapedsavepath, simplePolar(img, sky_threshold, horizontal_extent, outputw));
+			}
+			else if (savemode == RENDER_FULL) {
+				RenderWorkspace ws;
+				written = cv::imwrite(escapedsavepath, equirectToFisheye(img, sky_threshold, horizontal_extent, move_down, rotate_down, outputw, ws));
+			}
+			else {
+				std::unique_ptr<StripWriter> writer;
+				if (savemode == RENDER_STREAMED) writer = openStripWriter(escapedsavepath, outputw, outputw, &progress);
+				else writer.reset(new ImwriteStripWriter(escapedsavepath, outputw, outputw));
+				SourcePyramid pyramid;
+				written = writer && equirectToFisheyeBanded(img, sky_threshold, horizontal_extent, move_down, rotate_down, outputw, savebandh,
+					mipmap ? &pyramid : NULL, [&](const cv::Mat& band, int /*firstrow*/) {
+						return writer->writeRows(band);
+					});
+				written = writer && writer->finish() && written;
+			}
+		} catch (...) {
+			std::cout << "Exception occurred while rendering!" << std::endl;
+			written = false;
+		}
+	}
+	if (!written) {
+		std::cout << "Could not write the image: " << escapedsavepath << std::endl;
+		// no half written files
+		if (progress.opened) remove(escapedsavepath.c_str());
+		return 1;
+	}
+	std::cout << "Saved " << escapedsavepath << std::endl;
+	return 0;
+}
+#endif
@@ -0,0 +1,99 @@
+// Saves a fisheye through the YCbCr 4:2:0 path, with and without mip-mapping,
+// and checks it against the BGR banded render of the same pan, within the
+// slack of the chroma subsampling and the JPEG's quantization. Also checks that
+// samples mapped outside the intermediate get the border value, black for luma
+// and 128 for chroma. Built by CMake as test_ycc when libjpeg is found, run by ctest.
+
+#define PAN2FULLDOME_CLI
+#define PAN2FULLDOME_NO_MAIN
+#include "../pan2fulldome.cpp"
+
+// per channel mean absolute difference allowed between the YCbCr and BGR renders
+#define MAX_MEAN_DIFF 4.
+// differences above MAX_PIXEL_DIFF, around the seam and the sky, allowed in this fraction of pixels
+#define MAX_PIXEL_DIFF 32
+#define MAX_OUTLIER_FRACTION 0.02
+
+int checkBorder(const cv::Mat& plane, float border)
+{
+	// maps every sample far outside plane, which should come out as border
+	// both cubic and mip-mapped. Returns the number of failures
+	int failures = 0;
+	cv::Mat map_x(4, 4, CV_32FC1, cv::Scalar(-100.f));
+	cv::Mat map_y(4, 4, CV_32FC1, cv::Scalar(-100.f));
+	std::vector<cv::Mat> levels(1, plane);
+	addMipLevels(levels);
+	cv::Mat cubic, mip;
+	remapTiled(plane, cubic, map_x, map_y, cv::INTER_CUBIC, cv::Scalar(border));
+	mipSample(levels, map_x, map_y, mip, border);
+	if (cv::countNonZero(cubic != (int)border) || cv::countNonZero(mip != (int)border)) {
+		std::cout << "Samples outside the plane are not " << border << std::endl;
+		failures++;
+	}
+	return failures;
+}
+
+int main()
+{
+	// a colourful pan, small enough to be decoded at full scale for a 256 px output
+	cv::Mat pan(500, 1000, CV_8UC3);
+	for (int y = 0; y < pan.rows; y++) {
+		for (int x = 0; x < pan.cols; x++) {
+			pan.at<cv::Vec3b>(y, x) = cv::Vec3b((uchar)(x / 4), (uchar)(y / 2), 200);
+		}
+	}
+	const std::string inpath = "test_ycc_in.jpg";
+	const std::string outpath = "test_ycc_out.jpg";
+	if (!cv::imwrite(inpath, pan)) {
+		std::cout << "Could not write " << inpath << std::endl;
+		return 1;
+	}
+	const int outputw = 256;
+	const int neededwidth = intermediateSize(outputw).width;
+	int failures = 0;
+	cv::Mat img = readPan(inpath, neededwidth);
+	for (int mipmap = 0; mipmap <= 1; mipmap++) {
+		bool written = false;
+		if (!saveFisheyeYcc(inpath, outpath, neededwidth, 0, 360, 0, -160, outputw, BAND_HEIGHT, mipmap != 0, written)
+			|| !written) {
+			std::cout << "The YCbCr save did not run, mipmap " << mipmap << std::endl;
+			failures++;
+			continue;
+		}
+		cv::Mat out = cv::imread(outpath, cv::IMREAD_COLOR);
+		if (out.size() != cv::Size(outputw, outputw)) {
+			std::cout << "Could not read " << outpath << std::endl;
+			failures++;
+			continue;
+		}
+		// the same fisheye through the BGR path
+		SourcePyramid pyramid;
+		cv::Mat ref(outputw, outputw, CV_8UC3);
+		equirectToFisheyeBanded(img, 0, 360, 0, -160, outputw, BAND_HEIGHT, mipmap ? &pyramid : NULL,
+			[&](const cv::Mat& band, int firstrow) {
+				band.copyTo(ref.rowRange(firstrow, firstrow + band.rows));
+				return true;
+			});
+		cv::Mat diff, maxdiff;
+		cv::absdiff(out, ref, diff);
+		cv::Scalar mean = cv::mean(diff);
+		// the largest of the three channels' differences, per pixel
+		cv::reduce(diff.reshape(1, outputw * outputw), maxdiff, 1, cv::REDUCE_MAX);
+		double outliers = (double)cv::countNonZero(maxdiff > MAX_PIXEL_DIFF) / (outputw * outputw);
+		std::cout << "mipmap " << mipmap << ": mean difference " << mean[0] << "," << mean[1] << "," << mean[2]
+			<< " (BGR), " << outliers * 100 << "% of pixels differ by more than " << MAX_PIXEL_DIFF << std::endl;
+		if (mean[0] > MAX_MEAN_DIFF || mean[1] > MAX_MEAN_DIFF || mean[2] > MAX_MEAN_DIFF
+			|| outliers > MAX_OUTLIER_FRACTION) {
+			std::cout << "The YCbCr render does not match the BGR render, mipmap " << mipmap << std::endl;
+			failures++;
+		}
+	}
+	remove(inpath.c_str());
+	remove(outpath.c_str());
+	// the luma and chroma borders
+	cv::Mat plane(64, 128, CV_8UC1, cv::Scalar(60));
+	failures += checkBorder(plane, 0.f);
+	failures += checkBorder(plane, 128.f);
+	if (failures == 0) std::cout << "YCbCr renders match the BGR renders" << std::endl;
+	return failures ? 1 : 0;
+}